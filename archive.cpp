@@ -0,0 +1,400 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<archive.hpp>
+#include<mmapper.hpp>
+#include<utils.hpp>
+
+#include<endian.h>
+#include<sys/stat.h>
+
+#include<algorithm>
+#include<cstring>
+#include<stdexcept>
+
+namespace {
+
+// Chunks of one file may come from several blocks.
+const size_t block_cache_size = 4;
+
+const uint64_t read_window = 64*1024*1024;
+
+void decode_section(const File &f, uint64_t offset, uint64_t size, LzmaDecoder &decoder, File &out) {
+    {
+        auto m = f.mmap(offset, size);
+        m.advise(ADVISE_WILLNEED);
+        decoder.decompress(m, m.size(), out.get(), "");
+    }
+    out.seek(0, SEEK_SET);
+}
+
+void decode_index(const File &f, const archive_trailer &t, uint32_t columns, LzmaDecoder &decoder,
+        EntryTable &table) {
+    const uint64_t table_size = NUM_INDEX_COLUMNS*sizeof(uint64_t);
+    if(t.index_size < table_size) {
+        throw std::runtime_error("Corrupt archive, index too small.");
+    }
+    uint64_t segment_sizes[NUM_INDEX_COLUMNS];
+    {
+        auto m = f.mmap(t.index_offset, table_size);
+        for(size_t i=0; i<NUM_INDEX_COLUMNS; i++) {
+            uint64_t size;
+            memcpy(&size, (const unsigned char*)m + i*sizeof(uint64_t), sizeof(size));
+            segment_sizes[i] = le64toh(size);
+        }
+    }
+    uint64_t offset = t.index_offset + table_size;
+    const uint64_t index_end = t.index_offset + t.index_size;
+    for(size_t i=0; i<NUM_INDEX_COLUMNS; i++) {
+        if(segment_sizes[i] > index_end - offset) {
+            throw std::runtime_error("Corrupt archive, index column outside of the index.");
+        }
+        if(columns & (1u << i)) {
+            File column(make_tempfile());
+            decode_section(f, offset, segment_sizes[i], decoder, column);
+            table.read(static_cast<index_column>(i), column, t.num_entries);
+        }
+        offset += segment_sizes[i];
+    }
+}
+
+}
+
+EntryTable read_entry_table(const std::string &fname, uint32_t columns) {
+    File f(fname, "rb");
+    const auto t = read_trailer(f);
+    EntryTable table;
+    decode_index(f, t, columns, *decoder_pool().acquire(), table);
+    return table;
+}
+
+PathLookup::PathLookup(File &archive) {
+    const auto t = read_trailer(archive);
+    if(t.path_table_size > 0) {
+        paths.open(archive, t.path_table_offset, t.path_table_size, t.num_entries);
+    }
+}
+
+bool PathLookup::find(const std::string &path, size_t &i) const {
+    if(paths.empty()) {
+        throw std::logic_error("Archive has no path table.");
+    }
+    uint32_t id;
+    if(!paths.find(path, id)) {
+        return false;
+    }
+    i = id;
+    return true;
+}
+
+ArchiveReader::ArchiveReader(const std::string &fname) : ArchiveReader(File(fname, "rb")) {
+}
+
+ArchiveReader::ArchiveReader(File &&archive) : f(std::move(archive)), decoder(decoder_pool().acquire()),
+    cache_size(block_cache_size), clock(0) {
+    t = read_trailer(f);
+    decode_index(f, t, ALL_COLUMNS, *decoder, table);
+    if(t.dict_table_size > 0) {
+        read_dict_table();
+    } else {
+        add_dict(dict_range{0, t.dict_offset, t.dict_size});
+    }
+    if(t.sparse_index_size > 0) {
+        File sparse_index(make_tempfile());
+        decompress_section(t.sparse_index_offset, t.sparse_index_size, sparse_index);
+        sparse.read(sparse_index, t.num_entries);
+    }
+    if(t.link_index_size > 0) {
+        File link_index(make_tempfile());
+        decompress_section(t.link_index_offset, t.link_index_size, link_index);
+        links.read(link_index, t.num_entries);
+        for(const auto &j : links.link_ids()) {
+            const auto target = links.target(j);
+            if(!S_ISREG(table.mode(j)) || !S_ISREG(table.mode(target)) ||
+                    table.uncompressed_size(j) != table.uncompressed_size(target)) {
+                throw std::runtime_error("Corrupt link index, link does not match its target.");
+            }
+        }
+    }
+    if(t.path_table_size > 0) {
+        paths.open(f, t.path_table_offset, t.path_table_size, t.num_entries);
+    }
+    if(is_chunked()) {
+        File chunk_index(make_tempfile());
+        decompress_section(t.chunk_index_offset, t.chunk_index_size, chunk_index);
+        chunks.read(chunk_index, t.num_entries);
+        for(size_t c=0; c<chunks.num_chunks(); c++) {
+            block_starts.push_back(chunks.block_offset(c));
+        }
+    } else {
+        // Files follow each other inside a block, only the first one
+        // records where the block starts.
+        entry_blocks.resize(table.size(), NO_OFFSET);
+        entry_starts.resize(table.size(), 0);
+        uint64_t cur_block = NO_OFFSET;
+        uint64_t pos = 0;
+        for(size_t j=0; j<table.size(); j++) {
+            if(!S_ISREG(table.mode(j)) || links.is_link(j)) {
+                continue;
+            }
+            if(table.offset(j) != NO_OFFSET) {
+                cur_block = table.offset(j);
+                pos = 0;
+                block_starts.push_back(cur_block);
+            }
+            entry_blocks[j] = cur_block;
+            entry_starts[j] = pos;
+            pos += stored_size(j);
+        }
+    }
+    std::sort(block_starts.begin(), block_starts.end());
+    block_starts.erase(std::unique(block_starts.begin(), block_starts.end()), block_starts.end());
+}
+
+void ArchiveReader::decompress_section(uint64_t offset, uint64_t size, File &out) {
+    decode_section(f, offset, size, *decoder, out);
+}
+
+void ArchiveReader::add_dict(const dict_range &r) {
+    std::string dict;
+    if(r.size > 0) {
+        File dict_file(make_tempfile());
+        decompress_section(r.offset, r.size, dict_file);
+        dict = dict_file.read(dict_file.size());
+    }
+    ranges.push_back(r);
+    dict_starts.push_back(r.start);
+    dicts.push_back(std::move(dict));
+}
+
+void ArchiveReader::read_dict_table() {
+    File table_file(make_tempfile());
+    decompress_section(t.dict_table_offset, t.dict_table_size, table_file);
+    const uint64_t num_ranges = table_file.read64le();
+    const uint64_t range_size = 3*sizeof(uint64_t);
+    if(num_ranges > table_file.size() / range_size ||
+            table_file.size() != sizeof(uint64_t) + num_ranges*range_size) {
+        throw std::runtime_error("Corrupt dictionary table, bad size.");
+    }
+    std::vector<dict_range> table(num_ranges);
+    for(auto &r : table) {
+        r.start = table_file.read64le();
+    }
+    for(auto &r : table) {
+        r.offset = table_file.read64le();
+    }
+    for(auto &r : table) {
+        r.size = table_file.read64le();
+    }
+    for(uint64_t k=0; k<num_ranges; k++) {
+        if(k > 0 && table[k].start <= table[k-1].start) {
+            throw std::runtime_error("Corrupt dictionary table, ranges out of order.");
+        }
+        add_dict(table[k]);
+        if(table[k].size > 0) {
+            // Dictionaries sit between blocks, so they also end the block before them.
+            block_starts.push_back(table[k].offset);
+        }
+    }
+}
+
+const File& ArchiveReader::decoded_block(uint64_t offset) {
+    ++clock;
+    for(auto &c : cache) {
+        if(c.offset == offset) {
+            c.last_use = clock;
+            return c.data;
+        }
+    }
+    auto next = std::upper_bound(block_starts.begin(), block_starts.end(), offset);
+    // Blocks are followed by the index.
+    const uint64_t block_end = next == block_starts.end() ? t.index_offset : *next;
+    if(next == block_starts.begin() || *(next-1) != offset || block_end > t.index_offset) {
+        throw std::runtime_error("Corrupt index, entry points outside of data blocks.");
+    }
+    cached_block *slot;
+    if(cache.size() < cache_size) {
+        cache.push_back(cached_block{offset, clock, make_tempfile()});
+        slot = &cache.back();
+    } else {
+        slot = &*std::min_element(cache.begin(), cache.end(), [](const cached_block &c1, const cached_block &c2) {
+            return c1.last_use < c2.last_use;
+        });
+        slot->offset = offset;
+        slot->last_use = clock;
+        slot->data = make_tempfile();
+    }
+    auto m = f.mmap(offset, block_end - offset);
+    m.advise(ADVISE_WILLNEED);
+    auto range = std::upper_bound(dict_starts.begin(), dict_starts.end(), offset);
+    const std::string empty;
+    const auto &dict = range == dict_starts.begin() ? empty : dicts[range - dict_starts.begin() - 1];
+    decoder->decompress(m, m.size(), slot->data.get(), dict);
+    slot->data.flush();
+    // Archive data is normally decoded once, keep it from crowding the page cache.
+    m.evict();
+    return slot->data;
+}
+
+void ArchiveReader::read_range(const File &block, uint64_t start, uint64_t size, const data_sink &sink) {
+    if(start + size > block.size()) {
+        throw std::runtime_error("Corrupt archive, entry extends past the end of its block.");
+    }
+    for(uint64_t done=0; done < size; done += read_window) {
+        auto m = block.mmap(start + done, std::min(read_window, size - done));
+        m.advise(ADVISE_SEQUENTIAL);
+        sink(m, m.size());
+    }
+}
+
+bool ArchiveReader::find(const std::string &path, size_t &i) const {
+    if(!paths.empty()) {
+        uint32_t id;
+        if(!paths.find(path, id)) {
+            return false;
+        }
+        i = id;
+        return true;
+    }
+    for(size_t j=0; j<table.size(); j++) {
+        if(table.path(j) == path) {
+            i = j;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ArchiveReader::is_sparse(size_t i) const {
+    const extent *first;
+    size_t count;
+    return sparse.extents(links.target(i), first, count);
+}
+
+uint64_t ArchiveReader::stored_size(size_t i) const {
+    const extent *first;
+    size_t count;
+    if(!sparse.extents(i, first, count)) {
+        return table.uncompressed_size(i);
+    }
+    uint64_t total = 0;
+    for(size_t j=0; j<count; j++) {
+        total += first[j].size;
+    }
+    return total;
+}
+
+void ArchiveReader::read_stored(size_t i, const data_sink &sink) {
+    i = links.target(i);
+    if(!S_ISREG(table.mode(i)) || stored_size(i) == 0) {
+        return;
+    }
+    if(is_chunked()) {
+        const auto &ids = chunks.chunk_ids();
+        for(auto r=chunks.first_ref(i); r<chunks.first_ref(i+1); r++) {
+            const auto c = ids[r];
+            read_range(decoded_block(chunks.block_offset(c)), chunks.start(c), chunks.size(c), sink);
+        }
+    } else {
+        read_range(decoded_block(entry_blocks[i]), entry_starts[i], stored_size(i), sink);
+    }
+}
+
+void ArchiveReader::read_data(size_t i, const extent_sink &sink) {
+    i = links.target(i);
+    const extent *x;
+    size_t count;
+    if(!sparse.extents(i, x, count)) {
+        uint64_t pos = 0;
+        read_stored(i, [&sink, &pos](const unsigned char *buf, size_t size) {
+            sink(pos, buf, size);
+            pos += size;
+        });
+        return;
+    }
+    const uint64_t file_size = table.uncompressed_size(i);
+    uint64_t prev_end = 0;
+    for(size_t j=0; j<count; j++) {
+        if(x[j].offset < prev_end || x[j].size > file_size - x[j].offset) {
+            throw std::runtime_error("Corrupt sparse index, extents out of order.");
+        }
+        prev_end = x[j].offset + x[j].size;
+    }
+    // Stored data is the extents one after the other.
+    size_t cur = 0;
+    uint64_t used = 0;
+    read_stored(i, [&](const unsigned char *buf, size_t size) {
+        while(size > 0) {
+            while(cur < count && used == x[cur].size) {
+                ++cur;
+                used = 0;
+            }
+            if(cur == count) {
+                throw std::runtime_error("Corrupt archive, sparse entry has too much data.");
+            }
+            const auto n = std::min<uint64_t>(size, x[cur].size - used);
+            sink(x[cur].offset + used, buf, n);
+            used += n;
+            buf += n;
+            size -= n;
+        }
+    });
+}
+
+void ArchiveReader::read_entry(size_t i, const data_sink &sink) {
+    static const unsigned char zeros[64*1024] = {};
+    uint64_t pos = 0;
+    auto fill_to = [&sink, &pos](uint64_t offset) {
+        while(pos < offset) {
+            const auto n = std::min<uint64_t>(offset - pos, sizeof(zeros));
+            sink(zeros, n);
+            pos += n;
+        }
+    };
+    read_data(i, [&](uint64_t offset, const unsigned char *buf, size_t size) {
+        fill_to(offset);
+        sink(buf, size);
+        pos += size;
+    });
+    if(S_ISREG(table.mode(i))) {
+        fill_to(table.uncompressed_size(i));
+    }
+}
+
+const File* ArchiveReader::entry_block(size_t i, uint64_t &start) {
+    i = links.target(i);
+    if(!S_ISREG(table.mode(i)) || table.uncompressed_size(i) == 0 || is_sparse(i)) {
+        return nullptr;
+    }
+    const File *block;
+    if(is_chunked()) {
+        const auto r = chunks.first_ref(i);
+        if(chunks.first_ref(i+1) != r + 1) {
+            return nullptr;
+        }
+        const auto c = chunks.chunk_ids()[r];
+        block = &decoded_block(chunks.block_offset(c));
+        start = chunks.start(c);
+    } else {
+        block = &decoded_block(entry_blocks[i]);
+        start = entry_starts[i];
+    }
+    if(start + table.uncompressed_size(i) > block->size()) {
+        throw std::runtime_error("Corrupt archive, entry extends past the end of its block.");
+    }
+    return block;
+}
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<entrytable.hpp>
+#include<file.hpp>
+#include<format.hpp>
+#include<lzmacoder.hpp>
+
+#include<functional>
+#include<string>
+#include<vector>
+
+// Receives file data along with its position in the file.
+typedef std::function<void(uint64_t offset, const unsigned char *buf, size_t size)> extent_sink;
+
+/*
+ * Decode only the given index columns of an archive. Meant for tools
+ * that look at a few properties of many archives.
+ */
+EntryTable read_entry_table(const std::string &fname, uint32_t columns);
+
+/*
+ * Finds entries by path from the trailer and the path table of an
+ * archive alone, without decoding its index. For one-shot lookups.
+ */
+class PathLookup final {
+public:
+    explicit PathLookup(File &archive);
+
+    bool has_path_table() const { return !paths.empty(); }
+    // Sets i to the entry with the given full path. Needs a path table.
+    bool find(const std::string &path, size_t &i) const;
+
+private:
+    PathTable paths;
+};
+
+/*
+ * Read access to the contents of an archive. Decoded blocks are kept
+ * in a few temp files so reading entries in archive order decodes
+ * every block once.
+ */
+class ArchiveReader final {
+public:
+    explicit ArchiveReader(const std::string &fname);
+    explicit ArchiveReader(File &&archive);
+    ArchiveReader(const ArchiveReader &) = delete;
+    ArchiveReader& operator=(const ArchiveReader &) = delete;
+
+    const archive_trailer& trailer() const { return t; }
+    const EntryTable& entries() const { return table; }
+    bool is_chunked() const { return t.chunk_index_size > 0; }
+    const ChunkTable& chunk_table() const { return chunks; }
+    const SparseTable& sparse_table() const { return sparse; }
+    // Where the dictionaries are, a single range for unmerged archives.
+    const std::vector<dict_range>& dict_ranges() const { return ranges; }
+
+    // Pass the contents of entry i to sink in pieces. Holes come as zeros.
+    void read_entry(size_t i, const data_sink &sink);
+
+    // Pass only the stored data of entry i, skipping the holes of a sparse file.
+    void read_data(size_t i, const extent_sink &sink);
+    bool is_sparse(size_t i) const;
+
+    // Reading a hard link reads the entry it links to.
+    bool is_link(size_t i) const { return links.is_link(i); }
+    size_t link_target(size_t i) const { return links.target(i); }
+
+    /*
+     * Find the entry with the given full path. Uses the path table if
+     * the archive has one and goes through all entries otherwise.
+     */
+    bool find(const std::string &path, size_t &i) const;
+    bool has_path_table() const { return !paths.empty(); }
+
+    /*
+     * The decoded block holding all of entry i and where the entry
+     * starts in it, or nullptr if the entry is empty or split over
+     * several chunks. Evicted block files are dropped, not reused, so
+     * a descriptor to one keeps its contents.
+     */
+    const File* entry_block(size_t i, uint64_t &start);
+
+    // How many decoded blocks to keep, default 4.
+    void set_cache_size(size_t blocks) { cache_size = blocks; }
+
+private:
+    const File& decoded_block(uint64_t offset);
+    void read_range(const File &block, uint64_t start, uint64_t size, const data_sink &sink);
+    void decompress_section(uint64_t offset, uint64_t size, File &out);
+    void read_stored(size_t i, const data_sink &sink);
+    void add_dict(const dict_range &r);
+    void read_dict_table();
+    uint64_t stored_size(size_t i) const;
+
+    struct cached_block {
+        uint64_t offset;
+        uint64_t last_use;
+        File data;
+    };
+
+    File f;
+    archive_trailer t;
+    EntryTable table;
+    ChunkTable chunks;
+    SparseTable sparse;
+    LinkTable links;
+    PathTable paths;
+    // Blocks from dict_starts[k] up to the next start use dicts[k].
+    std::vector<uint64_t> dict_starts;
+    std::vector<std::string> dicts;
+    std::vector<dict_range> ranges;
+    CoderPool<LzmaDecoder>::Handle decoder;
+    std::vector<uint64_t> block_starts;
+    std::vector<uint64_t> entry_blocks;
+    std::vector<uint64_t> entry_starts;
+    std::vector<cached_block> cache;
+    size_t cache_size;
+    uint64_t clock;
+};
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<condition_variable>
+#include<deque>
+#include<mutex>
+
+/*
+ * Fixed capacity queue between pipeline stages. Closing the queue wakes
+ * up both sides: the consumer drains what is left and producers are told
+ * to stop. Either side may close it, so a failing consumer does not leave
+ * producers blocked forever.
+ */
+template<typename T>
+class BoundedQueue final {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue& operator=(const BoundedQueue &) = delete;
+
+    // Returns false if the queue was closed and the item was dropped.
+    bool push(T item) {
+        std::unique_lock<std::mutex> l(m);
+        not_full.wait(l, [this] { return closed || items.size() < capacity; });
+        if(closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Returns false once the queue is closed and empty.
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> l(m);
+        not_empty.wait(l, [this] { return closed || !items.empty(); });
+        if(items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> l(m);
+        closed = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+private:
+    std::mutex m;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    const size_t capacity;
+    bool closed;
+};
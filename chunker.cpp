@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<chunker.hpp>
+
+#include<algorithm>
+#include<array>
+
+namespace {
+
+/*
+ * The gear table must never change, otherwise chunk boundaries and
+ * thus deduplication against older archives would change with it.
+ * It is generated with splitmix64 so it does not need to be spelled out.
+ */
+std::array<uint64_t, 256> make_gear_table() {
+    std::array<uint64_t, 256> table;
+    uint64_t state = 0x6a706b6a706b6a70ULL;
+    for(auto &t : table) {
+        uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        t = z ^ (z >> 31);
+    }
+    return table;
+}
+
+const std::array<uint64_t, 256> gear = make_gear_table();
+
+// Normalized chunking: a stricter mask before the average size and a
+// looser one after it keeps chunk sizes close to the average. The top
+// bits are used as they depend on the most bytes of the window.
+const uint64_t mask_small = 0xFFFF000000000000ULL;
+const uint64_t mask_large = 0xFFF0000000000000ULL;
+
+}
+
+size_t next_chunk_size(const unsigned char *data, size_t size) {
+    if(size <= CHUNK_MIN_SIZE) {
+        return size;
+    }
+    const size_t end = std::min(size, CHUNK_MAX_SIZE);
+    const size_t normal = std::min(end, CHUNK_AVG_SIZE);
+    uint64_t fp = 0;
+    size_t i = CHUNK_MIN_SIZE;
+    for(; i<normal; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if(!(fp & mask_small)) {
+            return i+1;
+        }
+    }
+    for(; i<end; i++) {
+        fp = (fp << 1) + gear[data[i]];
+        if(!(fp & mask_large)) {
+            return i+1;
+        }
+    }
+    return end;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<cstddef>
+#include<cstdint>
+
+const size_t CHUNK_MIN_SIZE = 4*1024;
+const size_t CHUNK_AVG_SIZE = 16*1024;
+const size_t CHUNK_MAX_SIZE = 64*1024;
+
+/*
+ * Content defined chunking with a gear rolling hash in the style of
+ * FastCDC. Returns the length of the first chunk of data. Boundaries
+ * depend only on nearby content, so an edit in a file moves at most
+ * the chunks around it.
+ */
+size_t next_chunk_size(const unsigned char *data, size_t size);
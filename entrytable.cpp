@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<entrytable.hpp>
+#include<file.hpp>
+#include<mmapper.hpp>
+
+#include<endian.h>
+
+#include<algorithm>
+#include<cstring>
+#include<stdexcept>
+
+namespace {
+
+uint16_t from_le(uint16_t i) { return le16toh(i); }
+uint32_t from_le(uint32_t i) { return le32toh(i); }
+uint64_t from_le(uint64_t i) { return le64toh(i); }
+
+template<typename T>
+void read_column(File &index, std::vector<T> &column, uint64_t num_entries) {
+    column.resize(num_entries);
+    index.read(column.data(), num_entries*sizeof(T));
+    for(auto &c : column) {
+        c = from_le(c);
+    }
+}
+
+}
+
+void EntryTable::read(index_column column, File &data, uint64_t n) {
+    num_entries = n;
+    switch(column) {
+    case COLUMN_SIZES: read_column(data, sizes, n); break;
+    case COLUMN_MODES: read_column(data, modes, n); break;
+    case COLUMN_UIDS: read_column(data, uids, n); break;
+    case COLUMN_GIDS: read_column(data, gids, n); break;
+    case COLUMN_ATIMES: read_column(data, atimes, n); break;
+    case COLUMN_MTIMES: read_column(data, mtimes, n); break;
+    case COLUMN_PARENTS:
+        read_column(data, parents, n);
+        for(uint64_t j=0; j<n; j++) {
+            if(parents[j] != NO_PARENT && parents[j] >= j) {
+                throw std::runtime_error("Corrupt index, parent entry follows its child.");
+            }
+        }
+        break;
+    case COLUMN_NAME_SIZES: {
+        std::vector<uint16_t> name_sizes;
+        read_column(data, name_sizes, n);
+        name_starts.resize(n+1);
+        name_starts[0] = 0;
+        for(uint64_t j=0; j<n; j++) {
+            name_starts[j+1] = name_starts[j] + name_sizes[j];
+        }
+        break;
+    }
+    case COLUMN_OFFSETS: read_column(data, offsets, n); break;
+    case COLUMN_NAMES:
+        if(name_starts.size() != n+1) {
+            throw std::runtime_error("Name sizes must be read before names.");
+        }
+        names = data.read(name_starts[n]);
+        break;
+    default:
+        throw std::runtime_error("Unknown index column.");
+    }
+}
+
+std::string EntryTable::basename(size_t i) const {
+    return names.substr(name_starts[i], name_starts[i+1] - name_starts[i]);
+}
+
+std::string EntryTable::path(size_t i) const {
+    if(parents[i] == NO_PARENT) {
+        return basename(i);
+    }
+    auto p = path(parents[i]);
+    p += '/';
+    p.append(names, name_starts[i], name_starts[i+1] - name_starts[i]);
+    return p;
+}
+
+fileinfo EntryTable::get(size_t i) const {
+    fileinfo f;
+    f.uncompressed_size = sizes[i];
+    f.mode = modes[i];
+    f.uid = uids[i];
+    f.gid = gids[i];
+    f.atime = atimes[i];
+    f.mtime = mtimes[i];
+    f.fname = path(i);
+    f.inode = 0;
+    f.device = 0;
+    f.nlink = 1;
+    f.allocated = f.uncompressed_size;
+    return f;
+}
+
+void ChunkTable::read(File &chunk_index, uint64_t num_entries) {
+    std::vector<uint32_t> counts;
+    const uint64_t num_chunks = chunk_index.read64le();
+    read_column(chunk_index, block_offsets, num_chunks);
+    read_column(chunk_index, starts, num_chunks);
+    read_column(chunk_index, sizes, num_chunks);
+    read_column(chunk_index, counts, num_entries);
+    ref_starts.resize(num_entries+1);
+    ref_starts[0] = 0;
+    for(uint64_t j=0; j<num_entries; j++) {
+        ref_starts[j+1] = ref_starts[j] + counts[j];
+    }
+    read_column(chunk_index, refs, ref_starts[num_entries]);
+    for(const auto &r : refs) {
+        if(r >= num_chunks) {
+            throw std::runtime_error("Corrupt chunk index, reference to missing chunk.");
+        }
+    }
+}
+
+void SparseTable::read(File &sparse_index, uint64_t num_entries) {
+    std::vector<uint32_t> counts;
+    std::vector<uint64_t> offsets, sizes;
+    const uint64_t num_sparse = sparse_index.read64le();
+    read_column(sparse_index, ids, num_sparse);
+    read_column(sparse_index, counts, num_sparse);
+    extent_starts.resize(num_sparse+1);
+    extent_starts[0] = 0;
+    for(uint64_t j=0; j<num_sparse; j++) {
+        if(ids[j] >= num_entries || (j > 0 && ids[j] <= ids[j-1])) {
+            throw std::runtime_error("Corrupt sparse index, bad entry id.");
+        }
+        extent_starts[j+1] = extent_starts[j] + counts[j];
+    }
+    read_column(sparse_index, offsets, extent_starts[num_sparse]);
+    read_column(sparse_index, sizes, extent_starts[num_sparse]);
+    all.resize(offsets.size());
+    for(size_t j=0; j<all.size(); j++) {
+        all[j] = extent{offsets[j], sizes[j]};
+    }
+}
+
+bool SparseTable::extents(size_t i, const extent *&first, size_t &count) const {
+    auto it = std::lower_bound(ids.begin(), ids.end(), i);
+    if(it == ids.end() || *it != i) {
+        return false;
+    }
+    const auto j = it - ids.begin();
+    first = all.data() + extent_starts[j];
+    count = extent_starts[j+1] - extent_starts[j];
+    return true;
+}
+
+void LinkTable::read(File &link_index, uint64_t num_entries) {
+    const uint64_t num_links = link_index.read64le();
+    read_column(link_index, ids, num_links);
+    read_column(link_index, targets, num_links);
+    for(uint64_t j=0; j<num_links; j++) {
+        if(ids[j] >= num_entries || (j > 0 && ids[j] <= ids[j-1])) {
+            throw std::runtime_error("Corrupt link index, bad entry id.");
+        }
+        if(targets[j] >= ids[j] || is_link(targets[j])) {
+            throw std::runtime_error("Corrupt link index, bad link target.");
+        }
+    }
+}
+
+bool LinkTable::is_link(size_t i) const {
+    return std::binary_search(ids.begin(), ids.end(), i);
+}
+
+size_t LinkTable::target(size_t i) const {
+    auto it = std::lower_bound(ids.begin(), ids.end(), i);
+    if(it == ids.end() || *it != i) {
+        return i;
+    }
+    return targets[it - ids.begin()];
+}
+
+PathTable::PathTable() : slots(nullptr), path_data(nullptr), num_slots(0), num_entries(0), path_data_size(0) {
+}
+
+PathTable::~PathTable() = default;
+
+void PathTable::open(const File &f, uint64_t offset, uint64_t size, uint64_t num_entries) {
+    if(size < sizeof(uint64_t)) {
+        throw std::runtime_error("Corrupt path table, too small.");
+    }
+    map.reset(new MMapper(f, offset, size));
+    const unsigned char *m = *map;
+    uint64_t count;
+    memcpy(&count, m, sizeof(count));
+    count = le64toh(count);
+    if(count == 0 || (count & (count - 1)) != 0 || count > size / PATH_SLOT_SIZE ||
+            size < sizeof(uint64_t) + count*PATH_SLOT_SIZE) {
+        throw std::runtime_error("Corrupt path table, bad size.");
+    }
+    num_slots = count;
+    slots = m + sizeof(uint64_t);
+    path_data = slots + num_slots*PATH_SLOT_SIZE;
+    path_data_size = size - sizeof(uint64_t) - num_slots*PATH_SLOT_SIZE;
+    this->num_entries = num_entries;
+    // Lookups jump around.
+    map->advise(ADVISE_RANDOM);
+}
+
+bool PathTable::find(const std::string &path, uint32_t &found) const {
+    const uint64_t h = path_hash(path);
+    // The table is never full, but do not trust that.
+    for(uint64_t probe=0, slot=h & (num_slots-1); probe<num_slots; probe++, slot=(slot+1) & (num_slots-1)) {
+        const unsigned char *s = slots + slot*PATH_SLOT_SIZE;
+        uint64_t slot_hash, start;
+        uint32_t id, length;
+        memcpy(&slot_hash, s, sizeof(slot_hash));
+        memcpy(&start, s + 8, sizeof(start));
+        memcpy(&id, s + 16, sizeof(id));
+        memcpy(&length, s + 20, sizeof(length));
+        id = le32toh(id);
+        if(id == NO_PARENT) {
+            return false;
+        }
+        if(le64toh(slot_hash) != h || le32toh(length) != path.size()) {
+            continue;
+        }
+        start = le64toh(start);
+        if(id >= num_entries || start > path_data_size || path.size() > path_data_size - start) {
+            throw std::runtime_error("Corrupt path table, bad slot.");
+        }
+        if(memcmp(path_data + start, path.data(), path.size()) == 0) {
+            found = id;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t ParentTracker::add(const std::string &fname, bool is_dir, uint32_t id, std::string &base) {
+    while(!dirs.empty()) {
+        const auto &d = dirs.back().first;
+        if(fname.size() > d.size() && fname[d.size()] == '/' && fname.compare(0, d.size(), d) == 0) {
+            break;
+        }
+        dirs.pop_back();
+    }
+    uint32_t parent = NO_PARENT;
+    if(dirs.empty()) {
+        base = fname;
+    } else {
+        parent = dirs.back().second;
+        base.assign(fname, dirs.back().first.size() + 1, std::string::npos);
+    }
+    if(is_dir) {
+        dirs.emplace_back(fname, id);
+    }
+    return parent;
+}
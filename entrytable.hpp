@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<fileutils.hpp>
+#include<format.hpp>
+
+#include<cstdint>
+#include<functional>
+#include<memory>
+#include<string>
+#include<vector>
+
+class File;
+class MMapper;
+
+const uint32_t NO_PARENT = (uint32_t)-1;
+
+/*
+ * The archive index in memory. Every column is stored contiguously in
+ * the same layout as in the serialized index. Names are kept in one
+ * arena and only hold the part of the path below the parent entry.
+ * Columns can be read one by one and only the accessors of columns
+ * that have been read may be used. Names need their sizes and parents.
+ */
+class EntryTable final {
+public:
+    EntryTable() : num_entries(0) {}
+
+    // Columns must be read in index order.
+    void read(index_column column, File &data, uint64_t num_entries);
+
+    size_t size() const { return num_entries; }
+
+    uint64_t uncompressed_size(size_t i) const { return sizes[i]; }
+    uint64_t mode(size_t i) const { return modes[i]; }
+    uint32_t uid(size_t i) const { return uids[i]; }
+    uint32_t gid(size_t i) const { return gids[i]; }
+    uint32_t atime(size_t i) const { return atimes[i]; }
+    uint32_t mtime(size_t i) const { return mtimes[i]; }
+    uint32_t parent(size_t i) const { return parents[i]; }
+    uint64_t offset(size_t i) const { return offsets[i]; }
+    const std::vector<uint64_t>& entry_offsets() const { return offsets; }
+
+    std::string basename(size_t i) const;
+    std::string path(size_t i) const;
+
+    // Materialize one entry for code that works on fileinfo.
+    fileinfo get(size_t i) const;
+
+private:
+    std::vector<uint64_t> sizes;
+    std::vector<uint64_t> modes;
+    std::vector<uint32_t> uids;
+    std::vector<uint32_t> gids;
+    std::vector<uint32_t> atimes;
+    std::vector<uint32_t> mtimes;
+    std::vector<uint32_t> parents;
+    std::vector<uint64_t> offsets;
+    std::vector<uint64_t> name_starts;
+    std::string names;
+    uint64_t num_entries;
+};
+
+/*
+ * Where the content defined chunks of a deduplicated archive are
+ * and which chunks make up each entry.
+ */
+class ChunkTable final {
+public:
+    void read(File &chunk_index, uint64_t num_entries);
+
+    size_t num_chunks() const { return block_offsets.size(); }
+    uint64_t block_offset(size_t chunk) const { return block_offsets[chunk]; }
+    uint32_t start(size_t chunk) const { return starts[chunk]; }
+    uint32_t size(size_t chunk) const { return sizes[chunk]; }
+
+    // Chunk ids of entry i are chunk_ids()[first_ref(i)] to chunk_ids()[first_ref(i+1)-1].
+    uint64_t first_ref(size_t i) const { return ref_starts[i]; }
+    const std::vector<uint32_t>& chunk_ids() const { return refs; }
+
+private:
+    std::vector<uint64_t> block_offsets;
+    std::vector<uint32_t> starts;
+    std::vector<uint32_t> sizes;
+    std::vector<uint64_t> ref_starts;
+    std::vector<uint32_t> refs;
+};
+
+/*
+ * Data extents of the sparse files of an archive.
+ */
+class SparseTable final {
+public:
+    void read(File &sparse_index, uint64_t num_entries);
+
+    // Sets the extents of entry i. Returns false if it is not sparse.
+    bool extents(size_t i, const extent *&first, size_t &count) const;
+
+private:
+    std::vector<uint32_t> ids;
+    std::vector<uint64_t> extent_starts;
+    std::vector<extent> all;
+};
+
+/*
+ * Hard links of an archive and the entries holding their data.
+ */
+class LinkTable final {
+public:
+    void read(File &link_index, uint64_t num_entries);
+
+    bool is_link(size_t i) const;
+    // The entry with the data of entry i, which is i itself if it is not a link.
+    size_t target(size_t i) const;
+
+    const std::vector<uint32_t>& link_ids() const { return ids; }
+
+private:
+    std::vector<uint32_t> ids;
+    std::vector<uint32_t> targets;
+};
+
+/*
+ * The path table of an archive, used in place from a mapping of the
+ * archive file. A lookup only touches the slots it probes.
+ */
+class PathTable final {
+public:
+    PathTable();
+    PathTable(const PathTable &) = delete;
+    PathTable& operator=(const PathTable &) = delete;
+    ~PathTable();
+
+    void open(const File &f, uint64_t offset, uint64_t size, uint64_t num_entries);
+    bool empty() const { return num_slots == 0; }
+
+    // Sets id to the entry with the given full path if there is one.
+    bool find(const std::string &path, uint32_t &id) const;
+
+private:
+    std::unique_ptr<MMapper> map;
+    const unsigned char *slots;
+    const unsigned char *path_data;
+    uint64_t num_slots;
+    uint64_t num_entries;
+    uint64_t path_data_size;
+};
+
+/*
+ * Splits full paths into parent id and basename in traversal order.
+ * Only the chain of directories above the current entry is remembered.
+ */
+class ParentTracker final {
+public:
+    // Returns the parent id and sets base to the name below it.
+    uint32_t add(const std::string &fname, bool is_dir, uint32_t id, std::string &base);
+
+    // The current directory chain as path and id, for saving and restoring.
+    typedef std::vector<std::pair<std::string, uint32_t>> chain;
+    const chain& dir_chain() const { return dirs; }
+    void set_dir_chain(chain c) { dirs = std::move(c); }
+
+private:
+    chain dirs;
+};
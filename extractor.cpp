@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<extractor.hpp>
+#include<file.hpp>
+#include<utils.hpp>
+
+#include<fcntl.h>
+#include<sys/stat.h>
+#include<unistd.h>
+#include<cerrno>
+
+#include<stdexcept>
+
+namespace {
+
+const mode_t DIR_CREATE_MODE = S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH;
+
+/*
+ * Split an archived path into its components. Empty and "." components
+ * are dropped so absolute and ./-prefixed names land under the output dir.
+ */
+std::vector<std::string> split_path(const std::string &fname) {
+    std::vector<std::string> components;
+    std::string::size_type start = 0;
+    while(start <= fname.size()) {
+        auto end = fname.find('/', start);
+        if(end == std::string::npos) {
+            end = fname.size();
+        }
+        std::string c = fname.substr(start, end - start);
+        if(c == "..") {
+            throw std::runtime_error("Archive entry contains \"..\": " + fname);
+        }
+        if(!c.empty() && c != ".") {
+            components.push_back(std::move(c));
+        }
+        start = end + 1;
+    }
+    return components;
+}
+
+std::string join_path(const std::vector<std::string> &components) {
+    std::string result;
+    for(const auto &c : components) {
+        if(!result.empty()) {
+            result += '/';
+        }
+        result += c;
+    }
+    return result;
+}
+
+void restore_metadata(int fd, const fileinfo &e, bool restore_owner) {
+    // Chown must come before chmod as it clears the setuid bits.
+    if(restore_owner && fchown(fd, e.uid, e.gid) != 0) {
+        throw_system("Could not set owner:");
+    }
+    if(fchmod(fd, e.mode & 07777) != 0) {
+        throw_system("Could not set permissions:");
+    }
+    struct timespec times[2];
+    times[0].tv_sec = e.atime;
+    times[0].tv_nsec = 0;
+    times[1].tv_sec = e.mtime;
+    times[1].tv_nsec = 0;
+    if(futimens(fd, times) != 0) {
+        throw_system("Could not set file times:");
+    }
+}
+
+}
+
+Extractor::Extractor(const std::string &outdir) : restore_owner(geteuid() == 0) {
+    root_fd = open(outdir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(root_fd < 0) {
+        std::string msg("Could not open output directory ");
+        msg += outdir;
+        msg += ":";
+        throw_system(msg.c_str());
+    }
+}
+
+Extractor::~Extractor() {
+    pop_to(0);
+    close(root_fd);
+}
+
+void Extractor::pop_to(size_t depth) {
+    while(dir_fds.size() > depth) {
+        close(dir_fds.back());
+        dir_fds.pop_back();
+        dir_names.pop_back();
+    }
+}
+
+/*
+ * Make the first depth components the current open directory chain,
+ * creating missing directories along the way. Entries come in traversal
+ * order so usually nothing needs to be done.
+ */
+int Extractor::enter_parents(const std::vector<std::string> &components, size_t depth) {
+    size_t common = 0;
+    while(common < dir_names.size() && common < depth && dir_names[common] == components[common]) {
+        ++common;
+    }
+    pop_to(common);
+    for(size_t i=common; i<depth; i++) {
+        int parent = dir_fds.empty() ? root_fd : dir_fds.back();
+        const char *name = components[i].c_str();
+        if(mkdirat(parent, name, DIR_CREATE_MODE) != 0 && errno != EEXIST) {
+            throw_system("Could not create directory:");
+        }
+        int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if(fd < 0) {
+            throw_system("Could not open directory:");
+        }
+        dir_fds.push_back(fd);
+        dir_names.push_back(components[i]);
+    }
+    return dir_fds.empty() ? root_fd : dir_fds.back();
+}
+
+void Extractor::add_dir(const fileinfo &e) {
+    auto components = split_path(e.fname);
+    if(components.empty()) {
+        return;
+    }
+    enter_parents(components, components.size());
+    fileinfo d(e);
+    d.fname = join_path(components);
+    pending_dirs.push_back(std::move(d));
+}
+
+void Extractor::add_file(const fileinfo &e, const std::function<void(File &ofile)> &fill, bool sparse) {
+    auto components = split_path(e.fname);
+    if(components.empty()) {
+        throw std::runtime_error("Archive entry has an empty file name.");
+    }
+    int parent = enter_parents(components, components.size() - 1);
+    int fd = openat(parent, components.back().c_str(),
+            O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if(fd < 0) {
+        std::string msg("Could not create file ");
+        msg += e.fname;
+        msg += ":";
+        throw_system(msg.c_str());
+    }
+    FILE *f = fdopen(fd, "wb");
+    if(!f) {
+        close(fd);
+        throw_system("Could not fdopen output file:");
+    }
+    File ofile(f);
+    if(sparse) {
+        // Holes are whatever is not written.
+        if(ftruncate(fd, e.uncompressed_size) != 0) {
+            throw_system("Could not set file size:");
+        }
+    } else {
+#ifdef __linux__
+        // Failure only means the file system can not preallocate, which is harmless.
+        if(e.uncompressed_size > 0) {
+            fallocate(fd, 0, 0, e.uncompressed_size);
+        }
+#endif
+    }
+    fill(ofile);
+    ofile.flush();
+    restore_metadata(fd, e, restore_owner);
+}
+
+void Extractor::add_link(const fileinfo &e, const std::string &target) {
+    auto components = split_path(e.fname);
+    const auto target_path = join_path(split_path(target));
+    if(components.empty() || target_path.empty()) {
+        throw std::runtime_error("Archive entry has an empty file name.");
+    }
+    int parent = enter_parents(components, components.size() - 1);
+    const char *name = components.back().c_str();
+    // Replace what is there like add_file does.
+    if(unlinkat(parent, name, 0) != 0 && errno != ENOENT) {
+        throw_system("Could not remove old file:");
+    }
+    if(linkat(root_fd, target_path.c_str(), parent, name, 0) != 0) {
+        std::string msg("Could not create hard link ");
+        msg += e.fname;
+        msg += ":";
+        throw_system(msg.c_str());
+    }
+}
+
+void Extractor::finish() {
+    pop_to(0);
+    // Children before parents so restrictive parent modes do not block us.
+    for(auto it = pending_dirs.rbegin(); it != pending_dirs.rend(); ++it) {
+        int fd = openat(root_fd, it->fname.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if(fd < 0) {
+            throw_system("Could not open directory:");
+        }
+        try {
+            restore_metadata(fd, *it, restore_owner);
+        } catch(...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+    }
+    pending_dirs.clear();
+}
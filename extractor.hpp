@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<fileutils.hpp>
+
+#include<functional>
+#include<string>
+#include<vector>
+
+class File;
+
+/*
+ * Writes entries under an output directory using directory file
+ * descriptors rather than full path strings. The chain of currently
+ * open directories is kept so that consecutive entries in the same
+ * directory do not walk the path again. Metadata is restored on the
+ * already open descriptor. Directory metadata is applied in finish()
+ * because creating children would otherwise clobber their times.
+ */
+class Extractor final {
+public:
+    explicit Extractor(const std::string &outdir);
+    Extractor(const Extractor &) = delete;
+    Extractor& operator=(const Extractor &) = delete;
+    ~Extractor();
+
+    void add_dir(const fileinfo &e);
+    /*
+     * Create the file and let fill write its contents. A sparse file is
+     * created at its full size up front and fill only writes the data.
+     */
+    void add_file(const fileinfo &e, const std::function<void(File &ofile)> &fill, bool sparse = false);
+    // Make e a hard link to the already extracted file target.
+    void add_link(const fileinfo &e, const std::string &target);
+    void finish();
+
+private:
+    int enter_parents(const std::vector<std::string> &components, size_t depth);
+    void pop_to(size_t depth);
+
+    int root_fd;
+    bool restore_owner;
+    std::vector<std::string> dir_names;
+    std::vector<int> dir_fds;
+    std::vector<fileinfo> pending_dirs;
+};
@@ -75,6 +75,11 @@ MMapper File::mmap() const {
     return MMapper(*this);
 }
 
+MMapper File::mmap(uint64_t offset, uint64_t length) const {
+    flush();
+    return MMapper(*this, offset, length);
+}
+
 void File::read(void *buf, size_t bufsize) {
     if(fread(buf, 1, bufsize, f) != bufsize) {
         throw_system("Could not read data:");
@@ -132,6 +137,8 @@ std::string File::read(size_t bufsize) {
 }
 
 uint64_t File::size() const {
+    // Data still in the stdio buffer counts too.
+    flush();
     struct stat buf;
     if(fstat(fileno(), &buf) != 0) {
         throw_system("Statting self failed:");
@@ -145,6 +152,13 @@ void File::flush() const {
     }
 }
 
+void File::sync() const {
+    flush();
+    if(fsync(fileno()) != 0) {
+        throw_system("Syncing data failed:");
+    }
+}
+
 void File::write8(uint8_t i) {
     write(reinterpret_cast<const unsigned char*>(&i), sizeof(i));
 }
@@ -196,8 +210,14 @@ void File::write(const unsigned char *s, uint64_t size) {
 }
 
 void File::append(const File &source) {
-    auto m = source.mmap();
-    write(m, m.size());
+    // Map in windows so huge sources do not need address space for all of it.
+    const uint64_t window_size = 64*1024*1024;
+    const uint64_t total = source.size();
+    for(uint64_t offset=0; offset < total; offset += window_size) {
+        auto m = source.mmap(offset, std::min(window_size, total - offset));
+        m.advise(ADVISE_SEQUENTIAL);
+        write(m, m.size());
+    }
 }
 
 void File::clear() {
@@ -205,6 +225,14 @@ void File::clear() {
     ftruncate(fileno(), 0);
 }
 
+void File::truncate(uint64_t size) {
+    flush();
+    if(ftruncate(fileno(), size) != 0) {
+        throw_system("Could not truncate file:");
+    }
+    seek(size, SEEK_SET);
+}
+
 void File::copy_from(File &source, uint64_t num_bytes) {
     const uint64_t block_size=1024*1024;
     std::unique_ptr<unsigned char[]> buf(new unsigned char [block_size]);
@@ -216,3 +244,11 @@ void File::copy_from(File &source, uint64_t num_bytes) {
         copied += current_block_size;
     }
 }
+
+File make_tempfile() {
+    FILE *f = tmpfile();
+    if(!f) {
+        throw_system("Could not create temp file:");
+    }
+    return File(f);
+}
@@ -26,14 +26,13 @@ class File final {
 private:
 
     FILE *f;
-    void read(void *buf, size_t bufsize);
 
 public:
 
     File() : f(nullptr) {};
     File(const File &) = delete;
     File(File &&other) { f = other.f; other.f = nullptr; }
-    File& operator=(File &&other) { f = other.f; other.f = nullptr; return *this; }
+    File& operator=(File &&other) { if(this != &other) { close(); f = other.f; other.f = nullptr; } return *this; }
     ~File();
 
     File(const std::string &fname, const char *mode);
@@ -47,9 +46,12 @@ public:
     int fileno() const;
 
     MMapper mmap() const;
+    MMapper mmap(uint64_t offset, uint64_t length) const;
 
     uint64_t size() const;
     void flush() const;
+    // Flush and wait until the data is on disk.
+    void sync() const;
     void close();
 
     uint8_t read8();
@@ -60,6 +62,7 @@ public:
     uint32_t read32be();
     uint64_t read64be();
     std::string read(size_t bufsize);
+    void read(void *buf, size_t bufsize);
 
     void write8(uint8_t i);
     void write16le(uint16_t i);
@@ -74,5 +77,10 @@ public:
 
     void append(const File &source);
     void clear();
+    // Cut the file to size and move to its end.
+    void truncate(uint64_t size);
     void copy_from(File &source, uint64_t num_bytes);
 };
+
+// An anonymous file that is deleted when closed.
+File make_tempfile();
@@ -17,7 +17,6 @@
 
 #include<fileutils.hpp>
 #include<utils.hpp>
-#include<numeric>
 
 #ifdef _WIN32
 #include<WinSock2.h>
@@ -25,16 +24,26 @@
 #include<direct.h>
 #else
 #include<dirent.h>
+#include<fcntl.h>
+#include<unistd.h>
 #include<sys/stat.h>
 #include<sys/types.h>
 #endif
 
+#ifdef __linux__
+#include<sys/ioctl.h>
+#include<linux/fs.h>
+#include<linux/fiemap.h>
+#endif
+
+#include<array>
 #include<memory>
 #include<algorithm>
+#include<cerrno>
 
 namespace {
 
-std::vector<fileinfo> expand_entry(const std::string &fname);
+bool walk_entry(const std::string &fname, const std::function<bool(fileinfo &&)> &callback);
 
 fileinfo get_unix_stats(const std::string &fname) {
     struct stat buf;
@@ -61,6 +70,14 @@ fileinfo get_unix_stats(const std::string &fname) {
 #endif
     sd.mode = buf.st_mode;
     sd.uncompressed_size = buf.st_size;
+    sd.inode = buf.st_ino;
+    sd.device = buf.st_dev;
+    sd.nlink = buf.st_nlink;
+#ifdef _WIN32
+    sd.allocated = buf.st_size;
+#else
+    sd.allocated = (uint64_t)buf.st_blocks * 512;
+#endif
 //    sd.device_id = buf.st_rdev;
     return sd;
 }
@@ -110,35 +127,31 @@ std::vector<std::string> handle_dir_platform(const std::string &dirname) {
 }
 #endif
 
-std::vector<fileinfo> expand_dir(const std::string &dirname) {
-        // Always set order to create reproducible files.
-        std::vector<fileinfo> result;
-        auto entries = handle_dir_platform(dirname);
-        std::sort(entries.begin(), entries.end());
-        std::string fullpath;
-        for(const auto &base : entries) {
-            fullpath = dirname + '/' + base;
-            auto new_ones = expand_entry(fullpath);
-            std::move(new_ones.begin(), new_ones.end(), std::back_inserter(result));
+bool walk_dir(const std::string &dirname, const std::function<bool(fileinfo &&)> &callback) {
+    // Always set order to create reproducible files.
+    auto entries = handle_dir_platform(dirname);
+    std::sort(entries.begin(), entries.end());
+    std::string fullpath;
+    for(const auto &base : entries) {
+        fullpath.assign(dirname);
+        fullpath += '/';
+        fullpath += base;
+        if(!walk_entry(fullpath, callback)) {
+            return false;
         }
-        return result;
     }
+    return true;
+}
 
-std::vector<fileinfo> expand_entry(const std::string &fname) {
+bool walk_entry(const std::string &fname, const std::function<bool(fileinfo &&)> &callback) {
     auto fi = get_unix_stats(fname);
-    std::vector<fileinfo> result{fi};
-    if(is_symlink(fi)) {
-        return std::vector<fileinfo>{};
-    }
     if(is_dir(fi)) {
-        auto new_ones = expand_dir(fname);
-        std::move(new_ones.begin(), new_ones.end(), std::back_inserter(result));
-        return result;
+        return callback(std::move(fi)) && walk_dir(fname, callback);
     }
     if(is_file(fi)) {
-        return result;
+        return callback(std::move(fi));
     }
-    return std::vector<fileinfo>{};
+    return true;
 }
 
 std::string get_extension(const std::string &fname) {
@@ -162,11 +175,88 @@ bool extension_order(const fileinfo &f1, const fileinfo &f2) {
 }
 
 std::vector<fileinfo> expand_files(const std::vector<std::string> &originals) {
-    return std::accumulate(originals.begin(), originals.end(), std::vector<fileinfo>{}, [](std::vector<fileinfo> res, const std::string &s) {
-        auto n = expand_entry(s);
-        std::move(n.begin(), n.end(), std::back_inserter(res));
-        return res;
+    std::vector<fileinfo> result;
+    walk_files(originals, [&result](fileinfo &&f) {
+        result.push_back(std::move(f));
+        return true;
     });
+    return result;
+}
+
+bool walk_files(const std::vector<std::string> &originals, const std::function<bool(fileinfo &&)> &callback) {
+    for(const auto &s : originals) {
+        if(!walk_entry(s, callback)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifdef __linux__
+uint64_t physical_offset(const std::string &fname) {
+    int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return NO_OFFSET;
+    }
+    // Room for the header and exactly one extent.
+    std::array<uint64_t, (sizeof(fiemap) + sizeof(fiemap_extent))/sizeof(uint64_t) + 1> buf{};
+    auto fm = reinterpret_cast<fiemap*>(buf.data());
+    fm->fm_start = 0;
+    fm->fm_length = FIEMAP_MAX_OFFSET;
+    fm->fm_extent_count = 1;
+    int ret = ioctl(fd, FS_IOC_FIEMAP, fm);
+    close(fd);
+    if(ret != 0 || fm->fm_mapped_extents == 0) {
+        return NO_OFFSET;
+    }
+    return fm->fm_extents[0].fe_physical;
+}
+#else
+uint64_t physical_offset(const std::string &) {
+    return NO_OFFSET;
+}
+#endif
+
+#ifdef SEEK_HOLE
+std::vector<extent> data_extents(int fd, uint64_t size) {
+    std::vector<extent> extents;
+    off_t pos = 0;
+    while((uint64_t)pos < size) {
+        const off_t start = lseek(fd, pos, SEEK_DATA);
+        if(start < 0) {
+            if(errno == ENXIO) {
+                // Only a hole remains.
+                break;
+            }
+            return std::vector<extent>{extent{0, size}};
+        }
+        off_t end = lseek(fd, start, SEEK_HOLE);
+        if(end < 0) {
+            return std::vector<extent>{extent{0, size}};
+        }
+        end = std::min<off_t>(end, size);
+        if(start >= end) {
+            break;
+        }
+        extents.push_back(extent{(uint64_t)start, (uint64_t)(end - start)});
+        pos = end;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return extents;
+}
+#else
+std::vector<extent> data_extents(int, uint64_t size) {
+    return std::vector<extent>{extent{0, size}};
+}
+#endif
+
+void clamp_extents(std::vector<extent> &extents, uint64_t size) {
+    while(!extents.empty() && extents.back().offset >= size) {
+        extents.pop_back();
+    }
+    if(!extents.empty()) {
+        extents.back().size = std::min(extents.back().size, size - extents.back().offset);
+    }
 }
 
 bool is_symlink(const fileinfo &f) {
@@ -20,6 +20,7 @@
 #include<vector>
 #include<string>
 #include<cstdint>
+#include<functional>
 
 struct fileinfo {
     uint64_t uncompressed_size;
@@ -29,17 +30,52 @@ struct fileinfo {
     uint32_t atime;
     uint32_t mtime;
     std::string fname;
+    uint64_t inode; // Only used while packing, not stored.
+    uint64_t device; // Only used while packing.
+    uint64_t nlink; // Hard link count, only used while packing.
+    uint64_t allocated; // Bytes on disk, only used while packing.
     // FIXME missing checksum.
 };
 
 std::vector<fileinfo> expand_files(const std::vector<std::string> &originals);
 
+/*
+ * Visit the same entries as expand_files in the same order without
+ * keeping them in memory. Stops early and returns false if the callback
+ * returns false.
+ */
+bool walk_files(const std::vector<std::string> &originals, const std::function<bool(fileinfo &&)> &callback);
+
 /*
  * Reorder entries to maximize compression. That is, put file of similar
  * type and size next to each other.
  */
 void reorder_entries(std::vector<fileinfo> entries);
 
+/*
+ * Location of the first data extent of a file on its device, or
+ * NO_OFFSET if the file system does not say.
+ */
+uint64_t physical_offset(const std::string &fname);
+
+/*
+ * A range of a sparse file that holds data. Everything else is a hole.
+ */
+struct extent {
+    uint64_t offset;
+    uint64_t size;
+};
+
+/*
+ * The data ranges of an open file according to SEEK_DATA and SEEK_HOLE.
+ * Returns one extent for the whole file when it has no holes or the
+ * system can not tell.
+ */
+std::vector<extent> data_extents(int fd, uint64_t size);
+
+// Cut extents down to the first size bytes of the file.
+void clamp_extents(std::vector<extent> &extents, uint64_t size);
+
 bool is_symlink(const fileinfo &f);
 bool is_dir(const fileinfo &f);
 bool is_file(const fileinfo &f);
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<filters.hpp>
+
+#include<algorithm>
+#include<array>
+#include<cmath>
+#include<cstring>
+#include<stdexcept>
+
+namespace {
+
+// How much of a block is looked at when estimating the benefit of delta.
+const uint64_t delta_sample_size = 256*1024;
+
+const uint8_t delta_candidates[] = {1, 2, 3, 4, 6, 8, 12, 16, 24, 32};
+
+uint8_t elf_filter(const unsigned char *data, uint64_t size) {
+    if(size < 20 || memcmp(data, "\x7f" "ELF", 4) != 0) {
+        return FILTER_NONE;
+    }
+    // e_machine is at offset 18, endianness given by EI_DATA.
+    uint16_t machine = data[5] == 2 ? (data[18] << 8 | data[19]) : (data[19] << 8 | data[18]);
+    switch(machine) {
+    case 3:   // EM_386
+    case 62:  // EM_X86_64
+        return FILTER_X86;
+    case 40:  // EM_ARM
+        return FILTER_ARM;
+#ifdef LZMA_FILTER_ARM64
+    case 183: // EM_AARCH64
+        return FILTER_ARM64;
+#endif
+    default:
+        return FILTER_NONE;
+    }
+}
+
+double entropy(const std::array<uint64_t, 256> &histogram, uint64_t total) {
+    double e = 0;
+    for(const auto &count : histogram) {
+        if(count > 0) {
+            double p = double(count) / total;
+            e -= p*std::log2(p);
+        }
+    }
+    return e;
+}
+
+/*
+ * Numeric tables compress much better as differences between
+ * consecutive values. Compare order-0 entropy of the raw bytes against
+ * the delta coded ones for a few typical record widths.
+ */
+uint8_t best_delta_distance(const unsigned char *data, uint64_t size) {
+    const uint64_t sample = std::min(size, delta_sample_size);
+    if(sample <= 2*delta_candidates[sizeof(delta_candidates)-1]) {
+        return 0;
+    }
+    std::array<uint64_t, 256> histogram{};
+    for(uint64_t i=0; i<sample; i++) {
+        ++histogram[data[i]];
+    }
+    const double raw_entropy = entropy(histogram, sample);
+    double best_entropy = raw_entropy*0.75;
+    uint8_t best_distance = 0;
+    for(const auto distance : delta_candidates) {
+        histogram.fill(0);
+        for(uint64_t i=distance; i<sample; i++) {
+            ++histogram[(uint8_t)(data[i] - data[i-distance])];
+        }
+        auto e = entropy(histogram, sample - distance);
+        if(e < best_entropy) {
+            best_entropy = e;
+            best_distance = distance;
+        }
+    }
+    return best_distance;
+}
+
+}
+
+lzma_filter* setup_filters(const filter_chain &chain, void *lzma_options, filter_options &opts) {
+    int i = 0;
+    switch(chain.type) {
+    case FILTER_NONE:
+        break;
+    case FILTER_X86:
+        opts.filters[i++].id = LZMA_FILTER_X86;
+        break;
+    case FILTER_ARM:
+        opts.filters[i++].id = LZMA_FILTER_ARM;
+        break;
+    case FILTER_ARMTHUMB:
+        opts.filters[i++].id = LZMA_FILTER_ARMTHUMB;
+        break;
+#ifdef LZMA_FILTER_ARM64
+    case FILTER_ARM64:
+        opts.filters[i++].id = LZMA_FILTER_ARM64;
+        break;
+#endif
+    case FILTER_DELTA:
+        memset(&opts.delta, 0, sizeof(opts.delta));
+        opts.delta.type = LZMA_DELTA_TYPE_BYTE;
+        opts.delta.dist = chain.delta_distance;
+        opts.filters[i].id = LZMA_FILTER_DELTA;
+        opts.filters[i++].options = &opts.delta;
+        break;
+    default:
+        throw std::runtime_error("Unknown block filter.");
+    }
+    if(i > 0 && chain.type != FILTER_DELTA) {
+        // BCJ filters default to a zero start offset.
+        opts.filters[0].options = nullptr;
+    }
+    opts.filters[i].id = LZMA_FILTER_LZMA1;
+    opts.filters[i].options = lzma_options;
+    opts.filters[i+1].id = LZMA_VLI_UNKNOWN;
+    opts.filters[i+1].options = nullptr;
+    return opts.filters;
+}
+
+filter_chain choose_filters(const unsigned char *data, uint64_t size,
+        const std::vector<uint64_t> &file_starts) {
+    filter_chain chain;
+    std::array<uint64_t, 256> exec_bytes{};
+    for(size_t i=0; i<file_starts.size(); i++) {
+        const uint64_t start = file_starts[i];
+        const uint64_t end = i+1 < file_starts.size() ? file_starts[i+1] : size;
+        exec_bytes[elf_filter(data + start, end - start)] += end - start;
+    }
+    for(size_t i=FILTER_NONE+1; i<exec_bytes.size(); i++) {
+        if(exec_bytes[i] > size/2) {
+            chain.type = (uint8_t)i;
+            return chain;
+        }
+    }
+    auto distance = best_delta_distance(data, size);
+    if(distance > 0) {
+        chain.type = FILTER_DELTA;
+        chain.delta_distance = distance;
+    }
+    return chain;
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<lzma.h>
+
+#include<cstdint>
+#include<vector>
+
+/*
+ * Preprocessing filter run before LZMA1 in a block. The value is stored
+ * as the first byte of every block header so it must never change.
+ */
+enum block_filter : uint8_t {
+    FILTER_NONE = 0,
+    FILTER_X86 = 1,
+    FILTER_ARM = 2,
+    FILTER_ARMTHUMB = 3,
+    FILTER_ARM64 = 4,
+    FILTER_DELTA = 5,
+};
+
+struct filter_chain {
+    uint8_t type = FILTER_NONE;
+    uint8_t delta_distance = 0;
+};
+
+/*
+ * Storage for the options of a filter chain. Must outlive the lzma_filter
+ * array filled in by setup_filters.
+ */
+struct filter_options {
+    lzma_options_delta delta;
+    lzma_filter filters[3];
+};
+
+/*
+ * Fill opts.filters with the preprocessing stage of the chain followed
+ * by LZMA1 using the given options, and return it.
+ */
+lzma_filter* setup_filters(const filter_chain &chain, void *lzma_options, filter_options &opts);
+
+/*
+ * Pick a filter chain for a block of gathered files. file_starts holds the
+ * offset of every file in the block so executables can be recognized
+ * from their headers.
+ */
+filter_chain choose_filters(const unsigned char *data, uint64_t size,
+        const std::vector<uint64_t> &file_starts);
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<format.hpp>
+#include<file.hpp>
+
+#include<lzma.h>
+
+#include<stdexcept>
+
+uint64_t path_hash(const std::string &path) {
+    return lzma_crc64(reinterpret_cast<const uint8_t*>(path.data()), path.size(), 0);
+}
+
+void write_trailer(File &f, const archive_trailer &t) {
+    f.write32le(TRAILER_MAGIC);
+    f.write32le(FORMAT_VERSION);
+    f.write64le(t.num_entries);
+    f.write64le(t.index_offset);
+    f.write64le(t.index_size);
+    f.write64le(t.dict_offset);
+    f.write64le(t.dict_size);
+    f.write64le(t.chunk_index_offset);
+    f.write64le(t.chunk_index_size);
+    f.write64le(t.sparse_index_offset);
+    f.write64le(t.sparse_index_size);
+    f.write64le(t.link_index_offset);
+    f.write64le(t.link_index_size);
+    f.write64le(t.path_table_offset);
+    f.write64le(t.path_table_size);
+    f.write64le(t.dict_table_offset);
+    f.write64le(t.dict_table_size);
+}
+
+archive_trailer read_trailer(File &f) {
+    archive_trailer t;
+    if(f.size() < (uint64_t)TRAILER_SIZE || f.seek(-TRAILER_SIZE, SEEK_END) != 0) {
+        throw std::runtime_error("File too small, invalid archive.");
+    }
+    if(f.read32le() != TRAILER_MAGIC) {
+        // Archives from before the version was stored have a shorter trailer.
+        if(f.seek(-(TRAILER_SIZE - 4), SEEK_END) == 0 && f.read32le() == TRAILER_MAGIC) {
+            throw std::runtime_error("Archive is from an older version of jpak and can not be read.");
+        }
+        throw std::runtime_error("Bad magic number, invalid archive.");
+    }
+    const uint32_t version = f.read32le();
+    if(version != FORMAT_VERSION) {
+        throw std::runtime_error("Unsupported archive format version " + std::to_string(version) +
+                ", expected " + std::to_string(FORMAT_VERSION) + ".");
+    }
+    t.num_entries = f.read64le();
+    t.index_offset = f.read64le();
+    t.index_size = f.read64le();
+    t.dict_offset = f.read64le();
+    t.dict_size = f.read64le();
+    t.chunk_index_offset = f.read64le();
+    t.chunk_index_size = f.read64le();
+    t.sparse_index_offset = f.read64le();
+    t.sparse_index_size = f.read64le();
+    t.link_index_offset = f.read64le();
+    t.link_index_size = f.read64le();
+    t.path_table_offset = f.read64le();
+    t.path_table_size = f.read64le();
+    t.dict_table_offset = f.read64le();
+    t.dict_table_size = f.read64le();
+    return t;
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<cstdint>
+#include<string>
+
+class File;
+
+const uint32_t TRAILER_MAGIC = 12345678;
+
+/*
+ * Bumped whenever the layout of any part of an archive changes.
+ * Readers only accept archives of their own version.
+ */
+const uint32_t FORMAT_VERSION = 1;
+
+enum index_column {
+    COLUMN_SIZES,
+    COLUMN_MODES,
+    COLUMN_UIDS,
+    COLUMN_GIDS,
+    COLUMN_ATIMES,
+    COLUMN_MTIMES,
+    COLUMN_PARENTS,
+    COLUMN_NAME_SIZES,
+    COLUMN_OFFSETS,
+    COLUMN_NAMES,
+    NUM_INDEX_COLUMNS,
+};
+
+// Sets of columns to decode as bit masks.
+const uint32_t ALL_COLUMNS = (1u << NUM_INDEX_COLUMNS) - 1;
+const uint32_t NAME_COLUMNS = (1u << COLUMN_PARENTS) | (1u << COLUMN_NAME_SIZES) | (1u << COLUMN_NAMES);
+
+/*
+ * The index has these columns in order, one value per entry: size
+ * (u64), mode (u64), uid, gid, atime, mtime and parent entry id (u32),
+ * name length (u16), block offset (u64) and finally the names. A name
+ * is relative to its parent entry. Every column is a separately
+ * compressed block so that readers can decode only the columns they
+ * need. The index starts with the compressed size (u64) of each column
+ * and the columns follow in order.
+ *
+ * Deduplicated archives store file data as content defined chunks.
+ * They have a chunk index, another compressed block with the number of
+ * chunks (u64), then per chunk its block offset (u64), start within
+ * the decoded block and size (u32), then per entry the number of chunks
+ * (u32) and finally all chunk ids of all entries (u32). Block offsets
+ * in the main index are unused in this mode.
+ *
+ * Sparse files only store their data extents, one after the other. The
+ * sparse index is a compressed block with the number of sparse entries
+ * (u64), then per sparse entry its id and number of extents (u32), then
+ * all extents as offset and size (u64). Sizes in the main index are the
+ * full file sizes.
+ *
+ * A hard link to an earlier file is a regular file entry with no data
+ * of its own. The link index is a compressed block with the number of
+ * links (u64), then the ids of the link entries and then the ids of the
+ * entries they link to (u32). The linked to entry is the first one of
+ * the file and is never a link itself.
+ *
+ * The preset dictionary is only used for blocks without a filter.
+ *
+ * Archives made by merging others have a dictionary table instead of
+ * a single dictionary. It is a compressed block with the number of
+ * ranges (u64), then the offset where each range of blocks starts, then
+ * the offset and then the compressed size of its dictionary (u64). A
+ * range continues until the next one starts. A dictionary size of zero
+ * means that the blocks of the range have no dictionary.
+ *
+ * The optional path table maps full entry paths to entry ids without
+ * decoding the index. It is not compressed so it can be used in place.
+ * It has the number of slots (u64, a power of two) and then the slots.
+ * A slot is the path_hash and the offset of the full path (u64), the
+ * entry id and the length of the full path (u32), so a probe reads one
+ * record. Empty slots have the id -1. A path is looked for starting
+ * from the slot given by the low bits of its hash and going forward
+ * until an empty slot. The full paths follow the slots, offsets are
+ * relative to where they start. A candidate is confirmed against its
+ * full path.
+ */
+
+// A range of blocks that share a dictionary.
+struct dict_range {
+    uint64_t start;
+    uint64_t offset;
+    uint64_t size;
+};
+
+/*
+ * Fixed size record at the very end of an archive, starting with the
+ * magic number and the format version (u32). Everything else is found
+ * through the offsets stored here. A size of zero means that the
+ * optional section is not present.
+ */
+struct archive_trailer {
+    uint64_t num_entries = 0;
+    uint64_t index_offset = 0;
+    uint64_t index_size = 0;
+    uint64_t dict_offset = 0;
+    uint64_t dict_size = 0;
+    uint64_t chunk_index_offset = 0;
+    uint64_t chunk_index_size = 0;
+    uint64_t sparse_index_offset = 0;
+    uint64_t sparse_index_size = 0;
+    uint64_t link_index_offset = 0;
+    uint64_t link_index_size = 0;
+    uint64_t path_table_offset = 0;
+    uint64_t path_table_size = 0;
+    uint64_t dict_table_offset = 0;
+    uint64_t dict_table_size = 0;
+};
+
+const int64_t TRAILER_SIZE = 4 + 4 + 15*8;
+
+// Hash, path offset, entry id and path length.
+const uint64_t PATH_SLOT_SIZE = 8 + 8 + 4 + 4;
+
+// Hash of a full entry path for the path table.
+uint64_t path_hash(const std::string &path);
+
+void write_trailer(File &f, const archive_trailer &t);
+archive_trailer read_trailer(File &f);
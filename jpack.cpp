@@ -15,25 +15,199 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include<fileutils.hpp>
 #include<jpacker.hpp>
+#include<tuner.hpp>
+#include<getopt.h>
+#include<sys/resource.h>
+#include<cerrno>
+#include<cmath>
 #include<cstdio>
+#include<cstdlib>
+#include<cstring>
+
+namespace {
+
+void print_usage(const char *progname) {
+    printf("%s [options] [jpack file] [files to package].\n", progname);
+    printf("%s [options] --from-tar [tar file] [jpack file].\n", progname);
+    printf("\n");
+    printf("  -r, --read-ahead N   number of files to prefetch (default 16, 0 disables)\n");
+    printf("  -o, --read-order O   read input in name, inode or physical order (default name)\n");
+    printf("  -d, --dedup          store identical chunks of file data only once\n");
+    printf("  -p, --preset N       LZMA preset level 0-9 (default 6)\n");
+    printf("  -b, --block-size N   block size in kB (default 1024)\n");
+    printf("  -l, --path-table     store a table for looking up single entries quickly\n");
+    printf("  -f, --from-tar F     pack the entries of tar file F, - for standard input\n");
+    printf("  -t, --time-budget S  choose preset and block size to finish in S seconds\n");
+    printf("  -T, --target-throughput M\n");
+    printf("                       choose preset and block size to pack at M MB/s\n");
+    printf("  -c, --checkpoint S   save progress every S seconds so packing can be resumed\n");
+    printf("      --resume         continue an interrupted run with the same arguments\n");
+}
+
+// Used for --resume without -c.
+const uint32_t default_checkpoint_interval = 60;
+
+bool parse_uint(const char *s, uint64_t &out) {
+    char *end;
+    errno = 0;
+    out = strtoull(s, &end, 10);
+    return *s >= '0' && *s <= '9' && *end == '\0' && errno == 0;
+}
+
+bool parse_positive(const char *s, double &out) {
+    char *end;
+    out = strtod(s, &end);
+    return *s != '\0' && *end == '\0' && std::isfinite(out) && out > 0;
+}
+
+/*
+ * Every file in the read-ahead window is open, so leave half of the
+ * descriptors for everything else.
+ */
+uint64_t max_read_ahead() {
+    const uint64_t fallback = 1024;
+    struct rlimit lim;
+    if(getrlimit(RLIMIT_NOFILE, &lim) != 0 || lim.rlim_cur == RLIM_INFINITY) {
+        return fallback;
+    }
+    return lim.rlim_cur / 2;
+}
+
+}
 
 int main(int argc, char **argv) {
-    if(argc < 3) {
-        printf("%s [jpack file] [files to package].\n", argv[0]);
+    pack_options opts;
+    tuning_goal goal;
+    const struct option long_options[] = {
+        {"read-ahead", required_argument, nullptr, 'r'},
+        {"read-order", required_argument, nullptr, 'o'},
+        {"dedup", no_argument, nullptr, 'd'},
+        {"preset", required_argument, nullptr, 'p'},
+        {"block-size", required_argument, nullptr, 'b'},
+        {"path-table", no_argument, nullptr, 'l'},
+        {"from-tar", required_argument, nullptr, 'f'},
+        {"time-budget", required_argument, nullptr, 't'},
+        {"target-throughput", required_argument, nullptr, 'T'},
+        {"checkpoint", required_argument, nullptr, 'c'},
+        {"resume", no_argument, nullptr, 'R'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int c;
+    while((c = getopt_long(argc, argv, "r:o:dp:b:lf:t:T:c:h", long_options, nullptr)) != -1) {
+        switch(c) {
+        case 'r': {
+            uint64_t n;
+            if(!parse_uint(optarg, n)) {
+                printf("Invalid read ahead: %s\n", optarg);
+                return 1;
+            }
+            const uint64_t max = max_read_ahead();
+            if(n > max) {
+                printf("Read ahead limited to %llu by the number of open files allowed.\n",
+                        (unsigned long long)max);
+                n = max;
+            }
+            opts.read_ahead = n;
+            break;
+        }
+        case 'o':
+            if(strcmp(optarg, "name") == 0) {
+                opts.read_order = READ_LOGICAL;
+            } else if(strcmp(optarg, "inode") == 0) {
+                opts.read_order = READ_INODE;
+            } else if(strcmp(optarg, "physical") == 0) {
+                opts.read_order = READ_PHYSICAL;
+            } else {
+                printf("Unknown read order %s.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'd':
+            opts.dedup = true;
+            break;
+        case 'p': {
+            uint64_t n;
+            if(!parse_uint(optarg, n) || n > 9) {
+                printf("Preset must be between 0 and 9.\n");
+                return 1;
+            }
+            opts.preset = n;
+            break;
+        }
+        case 'b': {
+            // Chunk offsets within a block are 32 bits.
+            uint64_t n;
+            if(!parse_uint(optarg, n) || n == 0 || n > 1024*1024) {
+                printf("Block size must be between 1 kB and 1 GB.\n");
+                return 1;
+            }
+            opts.block_size = n*1024;
+            break;
+        }
+        case 'l':
+            opts.path_table = true;
+            break;
+        case 'f':
+            opts.tar_input = optarg;
+            break;
+        case 't':
+            if(!parse_positive(optarg, goal.time_budget)) {
+                printf("Time budget must be a positive number of seconds.\n");
+                return 1;
+            }
+            break;
+        case 'T':
+            if(!parse_positive(optarg, goal.throughput)) {
+                printf("Target throughput must be a positive number of MB/s.\n");
+                return 1;
+            }
+            goal.throughput *= 1024*1024;
+            break;
+        case 'c': {
+            uint64_t n;
+            if(!parse_uint(optarg, n) || n == 0 || n > UINT32_MAX) {
+                printf("Checkpoint interval must be at least one second.\n");
+                return 1;
+            }
+            opts.checkpoint_interval = n;
+            break;
+        }
+        case 'R':
+            opts.resume = true;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if(!opts.tar_input.empty()) {
+        if(argc - optind != 1) {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if(goal.time_budget > 0 || goal.throughput > 0) {
+            printf("Tuning needs to sample the input so it does not work with tar input.\n");
+            return 1;
+        }
+    } else if(argc - optind < 2) {
+        print_usage(argv[0]);
         return 1;
     }
     std::vector<std::string> originals;
-    for(int i=2; i<argc; i++) {
+    for(int i=optind+1; i<argc; i++) {
         originals.push_back(argv[i]);
     }
-    auto entries = expand_files(originals);
-    reorder_entries(entries);
-    /*
-    for(const auto &i : entries) {
-        printf("%s\n", i.fname.c_str());
-    }*/
-    jpack(argv[1], entries);
+    if(opts.resume && opts.checkpoint_interval == 0) {
+        opts.checkpoint_interval = default_checkpoint_interval;
+    }
+    if(goal.time_budget > 0 || goal.throughput > 0) {
+        tune_compression(originals, goal, opts);
+    }
+    jpack(argv[optind], originals, opts);
     return 0;
 }
@@ -16,170 +16,458 @@
  */
 
 #include<jpacker.hpp>
+#include<boundedqueue.hpp>
 #include<file.hpp>
 #include<mmapper.hpp>
+#include<packer.hpp>
+#include<tar.hpp>
 #include<utils.hpp>
 
-#include<lzma.h>
+#include<fcntl.h>
+#include<unistd.h>
 
-#include<memory>
+#include<algorithm>
+#include<chrono>
 #include<cstdio>
-#include<cassert>
+#include<deque>
+#include<exception>
+#include<memory>
+#include<stdexcept>
+#include<thread>
+#include<unordered_map>
 
 namespace {
 
-File compress_lzma(MMapper buf) {
-    const int CHUNK=1024*1024;
-    FILE *tmpf = tmpfile();
-    std::unique_ptr<unsigned char[]> out(new unsigned char [CHUNK]);
-    uint32_t filter_size;
-    if(!tmpf) {
-        throw_system("Could not create temp file: ");
-    }
-    File f(tmpf);
-    lzma_options_lzma opt_lzma;
-    lzma_stream strm = LZMA_STREAM_INIT;
-    if(lzma_lzma_preset(&opt_lzma, LZMA_PRESET_DEFAULT)) {
-        throw std::runtime_error("Unsupported LZMA preset.");
-    }
-    lzma_filter filter[2];
-    filter[0].id = LZMA_FILTER_LZMA1;
-    filter[0].options = &opt_lzma;
-    filter[1].id = LZMA_VLI_UNKNOWN;
-
-    lzma_ret ret = lzma_raw_encoder(&strm, filter);
-    if(ret != LZMA_OK) {
-        throw std::runtime_error("Could not create LZMA encoder.");
-    }
-    if(lzma_properties_size(&filter_size, filter) != LZMA_OK) {
-        throw std::runtime_error("Could not determine LZMA properties size.");
-    } else {
-        std::string x(filter_size, 'X');
-        if(lzma_properties_encode(filter, (unsigned char*)x.data()) != LZMA_OK) {
-            throw std::runtime_error("Could not encode filter properties.");
-        }
-        f.write8(9); // This is what Python's lzma lib does. Copy it without understanding.
-        f.write8(4);
-        f.write16le(filter_size);
-        f.write(x);
-    }
-    std::unique_ptr<lzma_stream, void(*)(lzma_stream*)> lcloser(&strm, lzma_end);
-
-    strm.avail_in = buf.size();
-    strm.next_in = buf;
-    /* compress until data ends */
-    lzma_action action = LZMA_RUN;
+// Pipeline queue lengths. These bound the memory used during packing
+// no matter how many entries there are.
+const size_t entry_queue_size = 4096;
+const size_t block_queue_size = 2;
+
+// Amount of file data over which reads are sorted when not reading in
+// archive order. The data waits in temp files, not in memory.
+const uint64_t reorder_window = 64*1024*1024;
+// Entries held in one window. Empty files, directories and links add
+// nothing to the data size, so that alone does not bound the window.
+const size_t max_window_entries = 65536;
+
+/*
+ * Find the data extents of a file that may have holes. Returns false if
+ * the whole file should be stored. A file that is all holes is sparse
+ * with no extents.
+ */
+bool sparse_extents(const fileinfo &e, const File &f, std::vector<extent> &extents) {
+    extents.clear();
+    // Files without holes take as much space as their size or more.
+    if(e.allocated >= e.uncompressed_size) {
+        return false;
+    }
+    extents = data_extents(f.fileno(), e.uncompressed_size);
+    if(extents.size() == 1 && extents[0].offset == 0 && extents[0].size == e.uncompressed_size) {
+        extents.clear();
+        return false;
+    }
+    return true;
+}
+
+uint64_t extents_size(const std::vector<extent> &extents) {
+    uint64_t total = 0;
+    for(const auto &x : extents) {
+        total += x.size;
+    }
+    return total;
+}
+
+/*
+ * Copy the data of a file to the end of out and return how much was
+ * copied. Only the data extents of a sparse file are copied, they are
+ * returned in extents and sparse is set.
+ */
+uint64_t read_file(File &out, fileinfo &e, File &ifile, bool &sparse, std::vector<extent> &extents) {
+    const auto start = out.tell();
+    sparse = sparse_extents(e, ifile, extents);
+    if(!sparse) {
+        out.append(ifile);
+        // Use what was actually read in case the file changed after stat.
+        e.uncompressed_size = out.tell() - start;
+        return e.uncompressed_size;
+    }
+    // The file may have shrunk after its extents were found.
+    const auto size = ifile.size();
+    clamp_extents(extents, size);
+    e.uncompressed_size = std::min(e.uncompressed_size, size);
+    for(const auto &x : extents) {
+        ifile.seek(x.offset);
+        out.copy_from(ifile, x.size);
+    }
+    return extents_size(extents);
+}
+
+// Store the data of a file into the job.
+void gather_file(block_job &job, fileinfo &e, File &ifile) {
+    job.file_starts.push_back(job.stored);
+    bool sparse;
+    std::vector<extent> extents;
+    job.stored += read_file(job.data, e, ifile, sparse, extents);
+    if(sparse) {
+        job.sparse.emplace_back(job.entries.size(), std::move(extents));
+    }
+}
+
+block_consumer push_to(BoundedQueue<block_job> &blocks) {
+    return [&blocks](block_job &&job) { return blocks.push(std::move(job)); };
+}
+
+/*
+ * An entry waiting to be read. Files are opened when they enter the
+ * read-ahead window so the kernel can fetch them while earlier files
+ * are being processed.
+ */
+struct pending_entry {
+    fileinfo e;
+    File f;
+    // Hard links to earlier files are not opened at all.
+    bool link;
+    uint32_t target;
+};
+
+void prefetch(const File &f, uint64_t block_size) {
+#ifdef POSIX_FADV_WILLNEED
+    // Only the beginning, big files are read sequentially anyway.
+    posix_fadvise(f.fileno(), 0, block_size, POSIX_FADV_WILLNEED);
+#else
+    (void)f;
+    (void)block_size;
+#endif
+}
+
+/*
+ * Pipeline stage that reads the contents of files into block jobs.
+ */
+void gather_blocks(BoundedQueue<fileinfo> &entries, BoundedQueue<block_job> &blocks, const pack_options &opts,
+        Deduplicator *dedup, uint32_t first_id) {
+    const size_t read_ahead = opts.read_ahead;
+    block_job job;
+    job.data = make_tempfile();
+    LinkDetector links(first_id);
+    std::deque<pending_entry> window;
+    bool more_entries = true;
     while(true) {
-        if(strm.total_in >= buf.size()) {
-            action = LZMA_FINISH;
-        } else {
-            strm.avail_out = CHUNK;
-            strm.next_out = out.get();
+        while(more_entries && window.size() <= read_ahead) {
+            pending_entry p;
+            if(!entries.pop(p.e)) {
+                more_entries = false;
+                break;
+            }
+            p.link = links.add(p.e, p.target);
+            if(is_file(p.e) && !p.link) {
+                p.f = File(p.e.fname, "rb");
+                if(read_ahead > 0) {
+                    prefetch(p.f, opts.block_size);
+                }
+            }
+            window.push_back(std::move(p));
+        }
+        if(window.empty()) {
+            break;
         }
-        ret = lzma_code(&strm, action);
-        if(strm.avail_out == 0 || ret == LZMA_STREAM_END) {
-            size_t write_size = CHUNK - strm.avail_out;
-            if (fwrite(out.get(), 1, write_size, f) != write_size || ferror(f)) {
-                throw_system("Could not write to file:");
+        auto e = std::move(window.front().e);
+        auto ifile = std::move(window.front().f);
+        const bool link = window.front().link;
+        const auto target = window.front().target;
+        window.pop_front();
+        if(block_full(job, e, opts.block_size)) {
+            if(!blocks.push(std::move(job))) {
+                return;
             }
-            strm.next_out = out.get();
-            strm.avail_out = CHUNK;
+            job = block_job();
+            job.data = make_tempfile();
         }
-
-        if(ret != LZMA_OK) {
-            if(ret == LZMA_STREAM_END) {
-                break;
+        if(link) {
+            job.links.emplace_back(job.entries.size(), target);
+            if(dedup) {
+                job.chunk_counts.push_back(0);
+            }
+        } else if(dedup) {
+            if(!is_file(e)) {
+                job.chunk_counts.push_back(0);
+            } else {
+                std::vector<extent> extents;
+                const bool sparse = sparse_extents(e, ifile, extents);
+                if(!gather_chunks(job, e, ifile, sparse, extents, *dedup, push_to(blocks), opts.block_size)) {
+                    return;
+                }
             }
-            throw std::runtime_error("Compression failed.");
+        } else if(is_file(e)) {
+            gather_file(job, e, ifile);
         }
+        job.entries.push_back(std::move(e));
     }
+    blocks.push(std::move(job));
+}
 
-    f.flush();
-    return f;
+/*
+ * Same as gather_blocks but reads the files of a window in the given
+ * order instead of archive order. They are read into a staging file
+ * first and the blocks are then laid out in archive order from what was
+ * actually read. The unfinished last job carries over to the next
+ * window, so the archive is the same as with archive order.
+ */
+void gather_blocks_sorted(BoundedQueue<fileinfo> &entries, BoundedQueue<block_job> &blocks, const pack_options &opts,
+        uint32_t first_id) {
+    struct pending_read {
+        std::pair<uint64_t, uint64_t> key;
+        size_t entry;
+    };
+    // Where the data of a file is in the staging file.
+    struct staged_file {
+        uint64_t start;
+        uint64_t size;
+        bool sparse;
+        std::vector<extent> extents;
+    };
+    LinkDetector links(first_id);
+    block_job job;
+    job.data = make_tempfile();
+    bool more_entries = true;
+    while(more_entries) {
+        std::vector<pending_entry> window;
+        std::vector<pending_read> reads;
+        uint64_t window_size = 0;
+        fileinfo e;
+        while(window_size < reorder_window && window.size() < max_window_entries
+                && (more_entries = entries.pop(e))) {
+            pending_entry p;
+            p.link = links.add(e, p.target);
+            if(is_file(e) && !p.link) {
+                uint64_t physical = opts.read_order == READ_PHYSICAL ? physical_offset(e.fname) : 0;
+                reads.push_back(pending_read{std::make_pair(physical, e.inode), window.size()});
+                window_size += std::min(e.allocated, e.uncompressed_size);
+            }
+            p.e = std::move(e);
+            window.push_back(std::move(p));
+        }
+        std::stable_sort(reads.begin(), reads.end(), [](const pending_read &r1, const pending_read &r2) {
+            return r1.key < r2.key;
+        });
+        File staging(make_tempfile());
+        std::vector<staged_file> staged(window.size());
+        for(const auto &r : reads) {
+            auto &s = staged[r.entry];
+            File ifile(window[r.entry].e.fname, "rb");
+            s.start = staging.tell();
+            s.size = read_file(staging, window[r.entry].e, ifile, s.sparse, s.extents);
+        }
+        for(size_t i=0; i<window.size(); i++) {
+            auto &p = window[i];
+            if(block_full(job, p.e, opts.block_size)) {
+                if(!blocks.push(std::move(job))) {
+                    return;
+                }
+                job = block_job();
+                job.data = make_tempfile();
+            }
+            if(p.link) {
+                job.links.emplace_back(job.entries.size(), p.target);
+            } else if(is_file(p.e)) {
+                auto &s = staged[i];
+                job.file_starts.push_back(job.stored);
+                if(s.size > 0) {
+                    auto m = staging.mmap(s.start, s.size);
+                    job.data.write(m, s.size);
+                }
+                job.stored += s.size;
+                if(s.sparse) {
+                    job.sparse.emplace_back(job.entries.size(), std::move(s.extents));
+                }
+            }
+            job.entries.push_back(std::move(p.e));
+        }
+    }
+    blocks.push(std::move(job));
 }
 
+/*
+ * Pipeline stage that turns a tar stream into block jobs. The stream
+ * supplies both the entries and their data, so there is no walker and
+ * no read-ahead.
+ */
+void gather_tar(TarReader &tar, BoundedQueue<block_job> &blocks, const pack_options &opts, Deduplicator *dedup) {
+    block_job job;
+    job.data = make_tempfile();
+    // The chunker wants to see a whole file at once.
+    File scratch;
+    if(dedup) {
+        scratch = make_tempfile();
+    }
+    // Hard links name their target by path, so like tar itself this
+    // remembers the path of every file.
+    std::unordered_map<std::string, uint32_t> file_ids;
+    uint32_t next_id = 0;
+    fileinfo e;
+    while(tar.next(e)) {
+        const auto &target = tar.link_target();
+        uint32_t target_id = 0;
+        if(!target.empty()) {
+            auto it = file_ids.find(target);
+            if(it == file_ids.end()) {
+                fprintf(stderr, "Skipping %s: its link target %s is not a file stored before it.\n",
+                        e.fname.c_str(), target.c_str());
+                continue;
+            }
+            target_id = it->second;
+        }
+        if(block_full(job, e, opts.block_size)) {
+            if(!blocks.push(std::move(job))) {
+                return;
+            }
+            job = block_job();
+            job.data = make_tempfile();
+        }
+        if(!target.empty()) {
+            job.links.emplace_back(job.entries.size(), target_id);
+            if(dedup) {
+                job.chunk_counts.push_back(0);
+            }
+        } else if(dedup) {
+            if(!is_file(e)) {
+                job.chunk_counts.push_back(0);
+            } else {
+                scratch.clear();
+                tar.read_sparse_data(scratch);
+                if(!gather_chunks(job, e, scratch, tar.is_sparse(), tar.sparse_extents(), *dedup, push_to(blocks), opts.block_size)) {
+                    return;
+                }
+            }
+        } else if(is_file(e)) {
+            job.file_starts.push_back(job.stored);
+            job.stored += tar.read_data(job.data);
+            if(tar.is_sparse()) {
+                job.sparse.emplace_back(job.entries.size(), tar.sparse_extents());
+            }
+        }
+        if(!target.empty()) {
+            // Links to this link go to the file with the data.
+            file_ids[e.fname] = target_id;
+        } else if(is_file(e)) {
+            file_ids[e.fname] = next_id;
+        } else {
+            // A later entry of the same name replaces the file.
+            file_ids.erase(e.fname);
+        }
+        ++next_id;
+        job.entries.push_back(std::move(e));
+    }
+    blocks.push(std::move(job));
 }
 
+File open_tar(const std::string &fname) {
+    if(fname != "-") {
+        return File(fname, "rb");
+    }
+    // A private stream so that closing it leaves stdin alone.
+    int fd = dup(STDIN_FILENO);
+    FILE *f = fd < 0 ? nullptr : fdopen(fd, "rb");
+    if(!f) {
+        if(fd >= 0) {
+            close(fd);
+        }
+        throw_system("Could not open standard input:");
+    }
+    return File(f);
+}
 
-void jpack(const char *ofname, const std::vector<fileinfo> &entries) {
-    File ofile(ofname, "wb");
-    ofile.write("JPAK0", 4);
-    std::vector<uint64_t> entry_offsets;
-    entry_offsets.reserve(entries.size());
-    // The proper way is to make lzma compressor a class that can be fed multiple files.
-    // This copies data over, but meh.
-    uint64_t stored_data = 0;
-    File gather_file(tmpfile());
-    // Bigger blocks improve compression but makes accessing single entries slower.
-    const uint64_t block_size = 1024*1024;
-    bool first_file_written = false;
-    for(auto &e : entries) {
-        uint64_t cur_offset = NO_OFFSET;
-        if(is_dir(e)) {
-            entry_offsets.push_back(NO_OFFSET);
-            continue;
-        }
-        // Compress data if there is more of it than the specified clump size.
-        if(stored_data >= block_size || !first_file_written) {
-            if(first_file_written) {
-                auto tmpfile = compress_lzma(gather_file.mmap());
-                ofile.append(tmpfile);
-                gather_file.clear();
-                printf("Starting new tmpfile.\n");
-                stored_data = 0;
-            }
-            cur_offset = ofile.tell();
-            first_file_written = true;
-        }
-        File ifile(e.fname, "r");
-        gather_file.append(ifile);
-        stored_data += ifile.size();
-        entry_offsets.push_back(cur_offset);
-    }
-    if(stored_data > 0) {
-        auto tmpfile = compress_lzma(gather_file.mmap());
-        ofile.append(tmpfile);
-    }
-    assert(entry_offsets.size() == entries.size());
-    uint64_t index_offset = ofile.tell();
-    File index(tmpfile());
-    // Now dump metadata one column at a time for maximal compression.
-    for(const auto &e : entries) {
-        index.write64le(e.uncompressed_size);
-    }
-    for(const auto &e : entries) {
-        index.write64le(e.mode);
-    }
-    for(const auto &e : entries) {
-        index.write32le(e.uid);
-    }
-    for(const auto &e : entries) {
-        index.write32le(e.gid);
-    }
-    for(const auto &e : entries) {
-        index.write32le(e.atime);
-    }
-    for(const auto &e : entries) {
-        index.write32le(e.mtime);
-    }
-    for(const auto &e : entries) {
-        index.write16le(e.fname.size());
-    }
-    for(const auto &o : entry_offsets) {
-        index.write64le(o);
-    }
-    // Filenames have variable length so they must be last.
-    for(const auto &e : entries) {
-        index.write(e.fname);
-    }
-    auto compressed_index = compress_lzma(index.mmap());
-//    printf("Index uncompressed: %d\n", (int)index.size());
-//    printf("Index compressed: %d\n", (int)compressed_index.tell());
-    ofile.append(compressed_index);
-    // Now done. Write suffix.
-    ofile.write32le(12345678);
-    ofile.write64le(entries.size());
-    ofile.write64le(index_offset);
-    ofile.write64le(compressed_index.size());
 }
 
+/*
+ * When resuming, the walk skips the entries already in the archive.
+ * Hard links to them are stored as copies since their ids are not known.
+ */
+void jpack(const char *ofname, const std::vector<std::string> &originals, const pack_options &opts) {
+    checkpoint_options ckpt;
+    if(opts.checkpoint_interval > 0 || opts.resume) {
+        if(opts.dedup || !opts.tar_input.empty()) {
+            throw std::runtime_error("Checkpoints can not be used with deduplication or tar input.");
+        }
+        ckpt.dir = std::string(ofname) + ".ckpt";
+        ckpt.resume = opts.resume;
+    }
+    Packer packer(ofname, opts.preset, opts.dedup, opts.path_table, ckpt);
+    const uint64_t skip = packer.num_entries();
+    const std::string resume_path = packer.last_path();
+    Deduplicator dedup;
+    BoundedQueue<fileinfo> entry_queue(entry_queue_size);
+    BoundedQueue<block_job> block_queue(block_queue_size);
+    std::exception_ptr walk_error, gather_error;
+    File tar_file;
+    std::unique_ptr<TarReader> tar;
+    if(!opts.tar_input.empty()) {
+        tar_file = open_tar(opts.tar_input);
+        tar.reset(new TarReader(tar_file));
+    }
+    // Traversal, reading and compression all run at the same time.
+    std::thread walker([&] {
+        try {
+            if(!tar) {
+                uint64_t skipped = 0;
+                walk_files(originals, [&](fileinfo &&f) {
+                    if(skipped < skip) {
+                        if(++skipped == skip && f.fname != resume_path) {
+                            throw std::runtime_error("Input changed since the checkpoint.");
+                        }
+                        return true;
+                    }
+                    return entry_queue.push(std::move(f));
+                });
+                if(skipped < skip) {
+                    throw std::runtime_error("Input changed since the checkpoint.");
+                }
+            }
+        } catch(...) {
+            walk_error = std::current_exception();
+        }
+        entry_queue.close();
+    });
+    std::thread gatherer([&] {
+        try {
+            if(tar) {
+                gather_tar(*tar, block_queue, opts, opts.dedup ? &dedup : nullptr);
+            } else if(opts.read_order == READ_LOGICAL || opts.dedup) {
+                gather_blocks(entry_queue, block_queue, opts, opts.dedup ? &dedup : nullptr, skip);
+            } else {
+                gather_blocks_sorted(entry_queue, block_queue, opts, skip);
+            }
+        } catch(...) {
+            gather_error = std::current_exception();
+            entry_queue.close();
+        }
+        block_queue.close();
+    });
+    try {
+        const auto interval = std::chrono::seconds(opts.checkpoint_interval);
+        auto last_checkpoint = std::chrono::steady_clock::now();
+        block_job job;
+        while(block_queue.pop(job)) {
+            packer.add(std::move(job));
+            if(interval.count() > 0 && std::chrono::steady_clock::now() - last_checkpoint >= interval) {
+                packer.checkpoint();
+                last_checkpoint = std::chrono::steady_clock::now();
+            }
+        }
+    } catch(...) {
+        entry_queue.close();
+        block_queue.close();
+        walker.join();
+        gatherer.join();
+        throw;
+    }
+    walker.join();
+    gatherer.join();
+    // Do not write a valid looking trailer for an incomplete archive.
+    if(walk_error) {
+        std::rethrow_exception(walk_error);
+    }
+    if(gather_error) {
+        std::rethrow_exception(gather_error);
+    }
+    packer.finish();
+}
@@ -19,4 +19,45 @@
 
 #include<fileutils.hpp>
 
-void jpack(const char *ofname, const std::vector<fileinfo> &entries);
+enum read_order_t {
+    READ_LOGICAL,  // Archive order.
+    READ_INODE,    // Inode number order within a window.
+    READ_PHYSICAL, // Order of first data extent on disk within a window.
+};
+
+struct pack_options {
+    // How many files ahead of the one being read are opened and
+    // prefetched. Zero disables read-ahead.
+    size_t read_ahead = 16;
+    // Order in which input files are read. The archive layout does not
+    // depend on it, only the seek pattern on the input disk.
+    read_order_t read_order = READ_LOGICAL;
+    // Store file data as content defined chunks, each unique chunk once.
+    // Files are then always read in archive order.
+    bool dedup = false;
+    // LZMA preset level, 0 (fastest) to 9 (smallest).
+    uint32_t preset = 6;
+    // Bigger blocks improve compression but make accessing single
+    // entries slower.
+    uint64_t block_size = 1024*1024;
+    // Write a path table so that single entries can be found without
+    // decoding the index.
+    bool path_table = false;
+    // Read entries from this tar file instead of walking the inputs.
+    // "-" means standard input.
+    std::string tar_input;
+    // Save progress every this many seconds so that an interrupted run
+    // can be resumed. Zero disables. Not supported with dedup or tar input.
+    uint32_t checkpoint_interval = 0;
+    // Continue the interrupted packing of the same inputs into the same
+    // archive from its last checkpoint.
+    bool resume = false;
+};
+
+/*
+ * Pack the given files and directories, or the contents of
+ * opts.tar_input if it is set. Traversal, reading and
+ * compression run concurrently with bounded memory use.
+ * Checkpoints are kept in ofname.ckpt until packing is done.
+ */
+void jpack(const char *ofname, const std::vector<std::string> &originals, const pack_options &opts);
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<archive.hpp>
+#include<entrytable.hpp>
+#include<file.hpp>
+#include<format.hpp>
+#include<packer.hpp>
+
+#include<getopt.h>
+#include<sys/stat.h>
+
+#include<cstdio>
+#include<cstring>
+#include<ctime>
+#include<exception>
+#include<string>
+#include<vector>
+
+namespace {
+
+enum list_format {
+    LIST_NAMES,
+    LIST_LONG,
+    LIST_TOTAL_SIZE,
+};
+
+void print_usage(const char *progname) {
+    printf("%s <command> [options] [arguments]\n", progname);
+    printf("\n");
+    printf("Commands:\n");
+    printf("  list [-l|-s] <archive>...   list archive contents\n");
+    printf("  merge <output> <archive>... combine archives without recompressing their data\n");
+    printf("\n");
+    printf("List options:\n");
+    printf("  -l, --long         also print mode, owner, size and modification time\n");
+    printf("  -s, --total-size   only print the total size of the files\n");
+}
+
+/*
+ * Only the index columns needed for the output are decoded, the file
+ * data and the rest of the index are not touched.
+ */
+void list_archive(const char *fname, list_format format) {
+    uint32_t columns = NAME_COLUMNS;
+    if(format == LIST_LONG) {
+        columns |= (1u << COLUMN_SIZES) | (1u << COLUMN_MODES) | (1u << COLUMN_UIDS) |
+            (1u << COLUMN_GIDS) | (1u << COLUMN_MTIMES);
+    } else if(format == LIST_TOTAL_SIZE) {
+        columns = (1u << COLUMN_SIZES) | (1u << COLUMN_MODES);
+    }
+    const auto table = read_entry_table(fname, columns);
+    if(format == LIST_TOTAL_SIZE) {
+        uint64_t total = 0;
+        for(size_t i=0; i<table.size(); i++) {
+            if(S_ISREG(table.mode(i))) {
+                total += table.uncompressed_size(i);
+            }
+        }
+        printf("%llu %s\n", (unsigned long long)total, fname);
+        return;
+    }
+    for(size_t i=0; i<table.size(); i++) {
+        if(format == LIST_LONG) {
+            char date[32];
+            const time_t mtime = table.mtime(i);
+            struct tm t;
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime_r(&mtime, &t));
+            printf("%07llo %5u %5u %12llu %s ", (unsigned long long)table.mode(i), table.uid(i), table.gid(i),
+                    (unsigned long long)table.uncompressed_size(i), date);
+        }
+        printf("%s\n", table.path(i).c_str());
+    }
+}
+
+int list_command(int argc, char **argv) {
+    list_format format = LIST_NAMES;
+    const struct option long_options[] = {
+        {"long", no_argument, nullptr, 'l'},
+        {"total-size", no_argument, nullptr, 's'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int c;
+    while((c = getopt_long(argc, argv, "ls", long_options, nullptr)) != -1) {
+        switch(c) {
+        case 'l':
+            format = LIST_LONG;
+            break;
+        case 's':
+            format = LIST_TOTAL_SIZE;
+            break;
+        default:
+            return 1;
+        }
+    }
+    if(optind >= argc) {
+        printf("No archives given.\n");
+        return 1;
+    }
+    for(int i=optind; i<argc; i++) {
+        if(format != LIST_TOTAL_SIZE && argc - optind > 1) {
+            printf("%s:\n", argv[i]);
+        }
+        list_archive(argv[i], format);
+    }
+    return 0;
+}
+
+/*
+ * The output is deduplicated if the inputs are and has a path table if
+ * any input has one.
+ */
+int merge_command(int argc, char **argv) {
+    if(argc < 3) {
+        printf("Usage: merge <output> <archive>...\n");
+        return 1;
+    }
+    bool dedup = false;
+    bool path_table = false;
+    struct stat out_st;
+    const bool out_exists = stat(argv[1], &out_st) == 0;
+    for(int i=2; i<argc; i++) {
+        struct stat st;
+        if(out_exists && stat(argv[i], &st) == 0 && st.st_dev == out_st.st_dev && st.st_ino == out_st.st_ino) {
+            printf("Output %s is also an input.\n", argv[1]);
+            return 1;
+        }
+        File f(argv[i], "rb");
+        const auto t = read_trailer(f);
+        if(i == 2) {
+            dedup = t.chunk_index_size > 0;
+        }
+        path_table = path_table || t.path_table_size > 0;
+    }
+    Packer packer(argv[1], LZMA_PRESET_DEFAULT, dedup, path_table);
+    for(int i=2; i<argc; i++) {
+        packer.merge(argv[i]);
+    }
+    packer.finish();
+    return 0;
+}
+
+}
+
+int main(int argc, char **argv) {
+    if(argc < 2 || strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+        print_usage(argv[0]);
+        return argc < 2 ? 1 : 0;
+    }
+    const std::string command(argv[1]);
+    try {
+        if(command == "list") {
+            return list_command(argc-1, argv+1);
+        }
+        if(command == "merge") {
+            return merge_command(argc-1, argv+1);
+        }
+    } catch(const std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    printf("Unknown command %s.\n", command.c_str());
+    print_usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,542 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<archive.hpp>
+#include<boundedqueue.hpp>
+#include<file.hpp>
+#include<protocol.hpp>
+#include<utils.hpp>
+
+#include<fcntl.h>
+#include<getopt.h>
+#include<sys/epoll.h>
+#include<sys/socket.h>
+#include<sys/stat.h>
+#include<sys/un.h>
+#include<unistd.h>
+
+#include<atomic>
+#include<cerrno>
+#include<cstdio>
+#include<cstring>
+#include<cstdlib>
+#include<functional>
+#include<list>
+#include<memory>
+#include<mutex>
+#include<stdexcept>
+#include<thread>
+#include<unordered_map>
+#include<vector>
+
+namespace {
+
+// Decoded blocks kept per archive, shared by all clients.
+const size_t cache_blocks = 64;
+
+// Every cached block holds a descriptor, keep the total well under 1024.
+const size_t max_archives = 8;
+
+const int listen_backlog = 64;
+
+// Requests are served by this many threads. A connection only holds
+// one while a request of it is being served.
+const size_t num_workers = 16;
+
+// Every client holds a descriptor too. Clients beyond this are told the
+// daemon is busy.
+const size_t max_clients = 256;
+
+// A client that stops in the middle of a request or does not read its
+// reply only holds a worker this long.
+const int request_timeout = 10;
+
+const int max_events = 64;
+
+const mode_t default_socket_mode = 0600;
+
+/*
+ * An archive served by the daemon. Paths are looked up from the path
+ * table of the archive, or from a map built here if it has none. With
+ * a path table the index is only decoded once an entry is needed. It
+ * is opened again if the file on disk is modified.
+ *
+ * The path table can be read by many threads at once, everything else
+ * is only touched with m held.
+ */
+struct served_archive {
+    explicit served_archive(File &&archive, const struct stat &st) : file(std::move(archive)),
+        lookup(file), mtime(st.st_mtim) {
+    }
+
+    // Needs m.
+    ArchiveReader& reader() {
+        if(!full) {
+            // The same open file, so both see the same archive.
+            full.reset(new ArchiveReader(std::move(file)));
+            full->set_cache_size(cache_blocks);
+            if(!lookup.has_path_table()) {
+                const auto &entries = full->entries();
+                for(size_t i=0; i<entries.size(); i++) {
+                    by_path.emplace(entries.path(i), i);
+                }
+            }
+        }
+        return *full;
+    }
+
+    bool find(const std::string &path, size_t &i) {
+        if(lookup.has_path_table()) {
+            return lookup.find(path, i);
+        }
+        std::lock_guard<std::mutex> l(m);
+        reader();
+        const auto it = by_path.find(path);
+        if(it == by_path.end()) {
+            return false;
+        }
+        i = it->second;
+        return true;
+    }
+
+    bool is_current(const struct stat &st) const {
+        return st.st_mtim.tv_sec == mtime.tv_sec && st.st_mtim.tv_nsec == mtime.tv_nsec;
+    }
+
+    std::mutex m;
+    File file;
+    PathLookup lookup;
+    std::unique_ptr<ArchiveReader> full;
+    std::unordered_map<std::string, size_t> by_path;
+    struct timespec mtime;
+};
+
+// Archives are told apart by their inode, not by any path.
+struct archive_key {
+    dev_t dev;
+    ino_t ino;
+    bool operator==(const archive_key &o) const {
+        return dev == o.dev && ino == o.ino;
+    }
+};
+
+struct key_hash {
+    size_t operator()(const archive_key &k) const { return k.ino ^ ((uint64_t)k.dev << 32); }
+};
+
+/*
+ * A read only descriptor of our own to an open file. Decoded blocks are
+ * passed this way so that clients can not change the cache under each
+ * other, and archives so that clients can not move the file offset the
+ * daemon reads with. A duplicate would share both, so there is no
+ * fallback.
+ */
+File reopen_readonly(const File &file) {
+    int fd = open(("/proc/self/fd/" + std::to_string(file.fileno())).c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        throw_system("Could not reopen file read only:");
+    }
+    FILE *f = fdopen(fd, "rb");
+    if(!f) {
+        close(fd);
+        throw_system("Could not fdopen block file:");
+    }
+    return File(f);
+}
+
+class ArchiveServer final {
+public:
+    /*
+     * Answer one request about the archive the client opened. If the
+     * reply comes with file data, passed is set to the file whose
+     * descriptor is sent along.
+     */
+    std::string handle(const std::string &request, const File &archive_file, File &passed) {
+        MessageReader r(request);
+        const auto op = r.get8();
+        const auto path = r.rest();
+        MessageWriter reply;
+        reply.put8(STATUS_OK);
+        const auto served = open(archive_file);
+        auto &archive = *served;
+        if(op == OP_LIST) {
+            std::lock_guard<std::mutex> l(archive.m);
+            const auto &entries = archive.reader().entries();
+            reply.put64le(entries.size());
+            for(size_t i=0; i<entries.size(); i++) {
+                auto e = entries.get(i);
+                if(e.fname.size() > UINT16_MAX) {
+                    throw std::runtime_error("Entry name too long to list.");
+                }
+                reply.put_stat(e);
+                reply.put16le(e.fname.size());
+                reply.put(e.fname);
+            }
+            return reply.data();
+        }
+        size_t i;
+        if(!archive.find(path, i)) {
+            throw std::runtime_error("No such entry: " + path);
+        }
+        // ArchiveReader is not thread safe, so requests to one archive
+        // are served one at a time.
+        std::lock_guard<std::mutex> l(archive.m);
+        auto &reader = archive.reader();
+        const auto &entries = reader.entries();
+        if(op == OP_STAT) {
+            reply.put_stat(entries.get(i));
+            return reply.data();
+        }
+        if(op != OP_READ) {
+            throw std::runtime_error("Unknown request.");
+        }
+        uint64_t start = 0;
+        const File *block = reader.entry_block(i, start);
+        if(block) {
+            passed = reopen_readonly(*block);
+        } else if(entries.uncompressed_size(i) > 0 && S_ISREG(entries.mode(i))) {
+            // Entries made of several chunks and sparse files are put
+            // together for this client only. Holes stay holes.
+            passed = make_tempfile();
+            if(ftruncate(passed.fileno(), entries.uncompressed_size(i)) != 0) {
+                throw_system("Could not set temp file size:");
+            }
+            reader.read_data(i, [&passed](uint64_t offset, const unsigned char *buf, size_t size) {
+                passed.seek(offset);
+                passed.write(buf, size);
+            });
+            passed.flush();
+        }
+        reply.put64le(passed.get() ? entries.uncompressed_size(i) : 0);
+        reply.put64le(start);
+        return reply.data();
+    }
+
+private:
+    /*
+     * The client opens the archive and passes its descriptor, so it can
+     * only ask about archives it can read itself. The archive is opened
+     * without holding m so that a slow open does not stall clients of
+     * other archives. An evicted archive stays alive until the requests
+     * using it are done.
+     */
+    std::shared_ptr<served_archive> open(const File &archive_file) {
+        struct stat st;
+        if(fstat(archive_file.fileno(), &st) != 0) {
+            throw_system("Could not stat archive:");
+        }
+        if(!S_ISREG(st.st_mode)) {
+            throw std::runtime_error("Archive is not a regular file.");
+        }
+        const archive_key key{st.st_dev, st.st_ino};
+        {
+            std::lock_guard<std::mutex> l(m);
+            auto cached = use(key, st);
+            if(cached) {
+                return cached;
+            }
+        }
+        std::shared_ptr<served_archive> fresh(new served_archive(reopen_readonly(archive_file), st));
+        std::lock_guard<std::mutex> l(m);
+        // Another client may have opened it in the meantime.
+        auto cached = use(key, st);
+        if(cached) {
+            return cached;
+        }
+        auto it = archives.find(key);
+        if(it != archives.end()) {
+            it->second.archive = fresh;
+            return fresh;
+        }
+        lru.push_front(key);
+        archives[key] = open_archive{fresh, lru.begin()};
+        if(archives.size() > max_archives) {
+            archives.erase(lru.back());
+            lru.pop_back();
+        }
+        return fresh;
+    }
+
+    // Needs m.
+    std::shared_ptr<served_archive> use(const archive_key &key, const struct stat &st) {
+        auto it = archives.find(key);
+        if(it == archives.end()) {
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, it->second.use);
+        if(!it->second.archive->is_current(st)) {
+            return nullptr;
+        }
+        return it->second.archive;
+    }
+
+    struct open_archive {
+        std::shared_ptr<served_archive> archive;
+        std::list<archive_key>::iterator use;
+    };
+
+    // Guards archives and lru, not the archives themselves.
+    std::mutex m;
+    std::unordered_map<archive_key, open_archive, key_hash> archives;
+    // Most recently used first.
+    std::list<archive_key> lru;
+};
+
+/*
+ * Only let in the users the socket mode lets in. The peer is checked
+ * by its primary group only.
+ */
+bool peer_allowed(int sock, mode_t mode) {
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if(getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+        return false;
+    }
+    if(cred.uid == 0 || cred.uid == geteuid() || (mode & 0007) != 0) {
+        return true;
+    }
+    return (mode & 0070) != 0 && cred.gid == getegid();
+}
+
+/*
+ * The archive descriptor that came with a request. Descriptors opened
+ * only for writing or with O_PATH do not show that the client may read
+ * the file, and reopening them would let it.
+ */
+File passed_archive(int fd) {
+    if(fd < 0) {
+        throw std::runtime_error("Request came without an archive descriptor.");
+    }
+    const int flags = fcntl(fd, F_GETFL);
+    if(flags < 0 || (flags & O_PATH) != 0 || (flags & O_ACCMODE) == O_WRONLY) {
+        close(fd);
+        throw std::runtime_error("Archive descriptor is not open for reading.");
+    }
+    FILE *f = fdopen(fd, "rb");
+    if(!f) {
+        close(fd);
+        throw_system("Could not fdopen archive:");
+    }
+    return File(f);
+}
+
+/*
+ * Serve one request of a client whose socket is readable. Returns false
+ * if the connection should be closed.
+ */
+bool serve_request(ArchiveServer &server, int sock) {
+    try {
+        std::string request;
+        int fd;
+        if(!recv_message(sock, request, &fd)) {
+            return false;
+        }
+        File archive_file;
+        File passed;
+        std::string reply;
+        try {
+            archive_file = passed_archive(fd);
+            reply = server.handle(request, archive_file, passed);
+        } catch(const std::exception &e) {
+            MessageWriter error;
+            error.put8(STATUS_ERROR);
+            error.put(e.what());
+            reply = error.data();
+            passed = File();
+        }
+        send_message(sock, reply, passed.get() ? passed.fileno() : -1);
+        return true;
+    } catch(const std::exception &e) {
+        fprintf(stderr, "Dropping client: %s\n", e.what());
+        return false;
+    }
+}
+
+// Wait for the next request of a client. Oneshot so that only one worker gets it.
+bool watch_client(int epfd, int sock, int op) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.fd = sock;
+    return epoll_ctl(epfd, op, sock, &ev) == 0;
+}
+
+void serve_requests(ArchiveServer &server, BoundedQueue<int> &ready, int epfd, std::atomic<size_t> &num_clients) {
+    int sock;
+    while(ready.pop(sock)) {
+        if(serve_request(server, sock) && watch_client(epfd, sock, EPOLL_CTL_MOD)) {
+            continue;
+        }
+        close(sock);
+        --num_clients;
+    }
+}
+
+void refuse_busy(int sock) {
+    MessageWriter error;
+    error.put8(STATUS_ERROR);
+    error.put("jpakd is busy, too many clients.");
+    try {
+        send_message(sock, error.data());
+    } catch(const std::exception &) {
+    }
+    close(sock);
+}
+
+bool set_timeouts(int sock) {
+    struct timeval timeout;
+    timeout.tv_sec = request_timeout;
+    timeout.tv_usec = 0;
+    return setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0 &&
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == 0;
+}
+
+int listen_on(const std::string &socket_path, mode_t mode) {
+    struct sockaddr_un addr;
+    if(socket_path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Socket path too long.");
+    }
+    // Nonblocking so that a connection that went away before accept
+    // does not block the event loop.
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(sock < 0) {
+        throw_system("Could not create socket:");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+    // A socket left over from an earlier run.
+    unlink(socket_path.c_str());
+    // Nobody else may connect before the mode is set.
+    const mode_t old_mask = umask(0177);
+    const int bound = bind(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    umask(old_mask);
+    if(bound != 0) {
+        close(sock);
+        throw_system("Could not bind socket:");
+    }
+    if(chmod(socket_path.c_str(), mode) != 0) {
+        close(sock);
+        throw_system("Could not set socket mode:");
+    }
+    if(listen(sock, listen_backlog) != 0) {
+        close(sock);
+        throw_system("Could not listen on socket:");
+    }
+    return sock;
+}
+
+void print_usage(const char *progname) {
+    printf("%s [options] <socket path>\n", progname);
+    printf("\n");
+    printf("  -m, --mode M     socket permissions in octal, default %03o\n", (unsigned)default_socket_mode);
+}
+
+}
+
+int main(int argc, char **argv) {
+    mode_t mode = default_socket_mode;
+    const struct option long_options[] = {
+        {"mode", required_argument, nullptr, 'm'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int c;
+    while((c = getopt_long(argc, argv, "m:h", long_options, nullptr)) != -1) {
+        switch(c) {
+        case 'm': {
+            char *end;
+            const unsigned long m = strtoul(optarg, &end, 8);
+            if(*optarg == '\0' || *end != '\0' || m > 0777) {
+                printf("Invalid socket mode: %s\n", optarg);
+                return 1;
+            }
+            mode = m;
+            break;
+        }
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc - 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    ArchiveServer server;
+    int listener = listen_on(argv[optind], mode);
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epfd < 0) {
+        throw_system("Could not create epoll instance:");
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = listener;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev) != 0) {
+        throw_system("Could not watch socket:");
+    }
+    // A client is in the queue at most once, so pushing never blocks.
+    BoundedQueue<int> ready(max_clients);
+    std::atomic<size_t> num_clients(0);
+    std::vector<std::thread> workers;
+    for(size_t i=0; i<num_workers; i++) {
+        workers.emplace_back(serve_requests, std::ref(server), std::ref(ready), epfd, std::ref(num_clients));
+    }
+    struct epoll_event events[max_events];
+    while(true) {
+        const int n = epoll_wait(epfd, events, max_events, -1);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw_system("Could not wait for clients:");
+        }
+        for(int i=0; i<n; i++) {
+            if(events[i].data.fd != listener) {
+                ready.push(events[i].data.fd);
+                continue;
+            }
+            int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if(client < 0) {
+                if(errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK) {
+                    continue;
+                }
+                throw_system("Could not accept connection:");
+            }
+            if(!peer_allowed(client, mode)) {
+                fprintf(stderr, "Refusing a client of another user.\n");
+                close(client);
+                continue;
+            }
+            if(num_clients >= max_clients) {
+                refuse_busy(client);
+                continue;
+            }
+            // Counted first, a worker may be done with it before watch_client returns.
+            ++num_clients;
+            if(!set_timeouts(client) || !watch_client(epfd, client, EPOLL_CTL_ADD)) {
+                fprintf(stderr, "Could not set up a client: %s\n", strerror(errno));
+                close(client);
+                --num_clients;
+            }
+        }
+    }
+}
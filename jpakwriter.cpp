@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<jpakwriter.hpp>
+
+#include<sys/stat.h>
+
+#include<memory>
+#include<stdexcept>
+#include<vector>
+
+namespace {
+
+// Same as between the jpack pipeline stages.
+const size_t block_queue_size = 2;
+
+const size_t source_buffer_size = 64*1024;
+
+}
+
+JpakWriter::JpakWriter(const std::string &fname, uint32_t preset, uint64_t block_size, bool dedup) :
+    packer(fname, preset, dedup), blocks(block_queue_size), block_size(block_size), dedup(dedup),
+    finished(false) {
+    job.data = make_tempfile();
+    if(dedup) {
+        scratch = make_tempfile();
+    }
+    compressor = std::thread([this] {
+        try {
+            block_job j;
+            while(blocks.pop(j)) {
+                packer.add(std::move(j));
+            }
+        } catch(...) {
+            error = std::current_exception();
+            blocks.close();
+        }
+    });
+}
+
+JpakWriter::~JpakWriter() {
+    stop();
+}
+
+void JpakWriter::add_dir(const std::string &path, const entry_metadata &meta) {
+    auto e = make_entry(path, meta, S_IFDIR);
+    start_entry(e);
+    if(dedup) {
+        job.chunk_counts.push_back(0);
+    }
+    job.entries.push_back(std::move(e));
+}
+
+void JpakWriter::add_file(const std::string &path, const entry_metadata &meta, const unsigned char *data,
+        uint64_t size) {
+    auto e = make_entry(path, meta, S_IFREG);
+    auto &target = start_file(e);
+    try {
+        target.write(data, size);
+    } catch(...) {
+        drop_file();
+        throw;
+    }
+    end_file(e, target);
+}
+
+void JpakWriter::add_file(const std::string &path, const entry_metadata &meta, const data_source &source) {
+    auto e = make_entry(path, meta, S_IFREG);
+    auto &target = start_file(e);
+    std::unique_ptr<unsigned char[]> buf(new unsigned char[source_buffer_size]);
+    try {
+        size_t n;
+        while((n = source(buf.get(), source_buffer_size)) > 0) {
+            target.write(buf.get(), n);
+        }
+    } catch(...) {
+        drop_file();
+        throw;
+    }
+    end_file(e, target);
+}
+
+void JpakWriter::finish() {
+    if(finished) {
+        throw std::runtime_error("Archive already finished.");
+    }
+    push(std::move(job));
+    stop();
+    check_error();
+    packer.finish();
+}
+
+fileinfo JpakWriter::make_entry(const std::string &path, const entry_metadata &meta, uint64_t type) const {
+    if(finished) {
+        throw std::runtime_error("Archive already finished.");
+    }
+    if(path.empty() || path[0] == '/' || path.back() == '/') {
+        throw std::runtime_error("Invalid entry path: " + path);
+    }
+    fileinfo e;
+    e.uncompressed_size = 0;
+    e.mode = type | (meta.mode & 07777);
+    e.uid = meta.uid;
+    e.gid = meta.gid;
+    e.atime = meta.atime;
+    e.mtime = meta.mtime;
+    e.fname = path;
+    e.inode = 0;
+    e.device = 0;
+    e.nlink = 1;
+    e.allocated = 0;
+    return e;
+}
+
+void JpakWriter::start_entry(const fileinfo &e) {
+    if(block_full(job, e, block_size)) {
+        push(std::move(job));
+        job = block_job();
+        job.data = make_tempfile();
+    }
+}
+
+/*
+ * File data goes straight into the block, or into the scratch file to
+ * be chunked from there.
+ */
+File& JpakWriter::start_file(const fileinfo &e) {
+    start_entry(e);
+    if(dedup) {
+        scratch.clear();
+        return scratch;
+    }
+    job.file_starts.push_back(job.stored);
+    return job.data;
+}
+
+void JpakWriter::end_file(fileinfo &e, const File &target) {
+    if(dedup) {
+        e.uncompressed_size = e.allocated = scratch.size();
+        // push() throws instead of returning false.
+        gather_chunks(job, e, scratch, false, std::vector<extent>(), deduplicator,
+                [this](block_job &&j) { push(std::move(j)); return true; }, block_size);
+    } else {
+        e.uncompressed_size = e.allocated = target.tell() - job.stored;
+        job.stored += e.uncompressed_size;
+    }
+    job.entries.push_back(std::move(e));
+}
+
+// Forget the data of a file that was not added after all.
+void JpakWriter::drop_file() {
+    if(dedup) {
+        scratch.clear();
+        return;
+    }
+    job.data.truncate(job.stored);
+    job.file_starts.pop_back();
+}
+
+void JpakWriter::push(block_job &&j) {
+    if(!blocks.push(std::move(j))) {
+        stop();
+        check_error();
+        throw std::runtime_error("Block compression stopped.");
+    }
+}
+
+void JpakWriter::stop() {
+    if(finished) {
+        return;
+    }
+    finished = true;
+    blocks.close();
+    compressor.join();
+}
+
+void JpakWriter::check_error() {
+    if(finished && error) {
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<boundedqueue.hpp>
+#include<packer.hpp>
+
+#include<cstdint>
+#include<exception>
+#include<functional>
+#include<string>
+#include<thread>
+
+struct entry_metadata {
+    // Permission bits, the file type comes from the call used.
+    uint64_t mode = 0644;
+    uint32_t uid = 0;
+    uint32_t gid = 0;
+    uint32_t atime = 0;
+    uint32_t mtime = 0;
+};
+
+// Fills buf with up to size bytes. Returns 0 at the end of the data.
+typedef std::function<size_t(unsigned char *buf, size_t size)> data_source;
+
+/*
+ * Builds an archive out of data that is not in the file system. The
+ * result is the same as what jpack writes. Entries are stored in the
+ * order they are added. Adding the contents of a directory right after
+ * it makes the index smaller, but any order works.
+ *
+ * Blocks are compressed in a background thread while more entries are
+ * being added. Errors from it are thrown from the next call.
+ */
+class JpakWriter final {
+public:
+    explicit JpakWriter(const std::string &fname, uint32_t preset = 6, uint64_t block_size = 1024*1024,
+            bool dedup = false);
+    JpakWriter(const JpakWriter &) = delete;
+    JpakWriter& operator=(const JpakWriter &) = delete;
+    // Without finish() the archive is left incomplete.
+    ~JpakWriter();
+
+    void add_dir(const std::string &path, const entry_metadata &meta);
+    void add_file(const std::string &path, const entry_metadata &meta, const unsigned char *data, uint64_t size);
+    // If source throws, the file is left out and more entries can be added.
+    void add_file(const std::string &path, const entry_metadata &meta, const data_source &source);
+
+    // Write out the remaining blocks and the index.
+    void finish();
+
+private:
+    fileinfo make_entry(const std::string &path, const entry_metadata &meta, uint64_t type) const;
+    void start_entry(const fileinfo &e);
+    File& start_file(const fileinfo &e);
+    void end_file(fileinfo &e, const File &target);
+    void drop_file();
+    void push(block_job &&job);
+    void stop();
+    void check_error();
+
+    Packer packer;
+    BoundedQueue<block_job> blocks;
+    std::thread compressor;
+    std::exception_ptr error;
+    block_job job;
+    Deduplicator deduplicator;
+    // Data waiting to be chunked when deduplicating.
+    File scratch;
+    const uint64_t block_size;
+    const bool dedup;
+    bool finished;
+};
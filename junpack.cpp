@@ -15,183 +15,207 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include<archive.hpp>
+#include<boundedqueue.hpp>
+#include<extractor.hpp>
 #include<file.hpp>
 #include<fileutils.hpp>
 #include<mmapper.hpp>
+#include<tar.hpp>
 #include<utils.hpp>
 
-#include<fcntl.h>
-#include<sys/stat.h>
-#include<cstdio>
-
-#include<lzma.h>
+#include<getopt.h>
+#include<unistd.h>
 
-#include<memory>
+#include<cstdio>
+#include<exception>
+#include<thread>
 
 namespace {
 
-void lzma_to_file(const unsigned char *data_start,
-                      uint64_t data_size,
-                      FILE *ofile) {
-    const int CHUNK=1024*1024;
-    std::unique_ptr<unsigned char[]> out(new unsigned char [CHUNK]);
-    lzma_stream strm = LZMA_STREAM_INIT;
-    lzma_filter filter[2];
-    unsigned int have;
+// Decoded data is handed to the tar writer in pieces of about this size.
+const uint64_t tar_job_size = 1024*1024;
+const size_t tar_queue_size = 2;
 
-    size_t offset = 2;
-    uint16_t properties_size = le16toh(*reinterpret_cast<const uint16_t*>(data_start + offset));
-    offset+=2;
-    filter[0].id = LZMA_FILTER_LZMA1;
-    filter[1].id = LZMA_VLI_UNKNOWN;
-    lzma_ret ret = lzma_properties_decode(&filter[0], nullptr, data_start + offset, properties_size);
-    offset += properties_size;
-    if(ret != LZMA_OK) {
-        throw std::runtime_error("Could not decode LZMA properties.");
-    }
-    ret = lzma_raw_decoder(&strm, &filter[0]);
-    free(filter[0].options);
-    if(ret != LZMA_OK) {
-        throw std::runtime_error("Could not initialize LZMA decoder.");
+/*
+ * Entries whose contents have been decoded into a temp file, waiting
+ * to be written out as tar.
+ */
+struct tar_job {
+    std::vector<fileinfo> entries;
+    std::vector<uint64_t> file_starts;
+    File data;
+    uint64_t stored = 0;
+};
+
+File open_output(const std::string &fname) {
+    if(fname != "-") {
+        return File(fname, "wb");
+    }
+    // A private stream so that closing it leaves stdout alone.
+    int fd = dup(STDOUT_FILENO);
+    FILE *f = fd < 0 ? nullptr : fdopen(fd, "wb");
+    if(!f) {
+        if(fd >= 0) {
+            close(fd);
+        }
+        throw_system("Could not open standard output:");
     }
-    std::unique_ptr<lzma_stream, void(*)(lzma_stream*)> lcloser(&strm, lzma_end);
-
-    const unsigned char *current = data_start + offset;
-    strm.avail_in = (size_t)(data_size - offset);
-    strm.next_in = current;
-    /* decompress until data ends */
-    do {
-        if (strm.total_in == data_size - offset)
-            break;
-
-        do {
-            strm.avail_out = CHUNK;
-            strm.next_out = out.get();
-            ret = lzma_code(&strm, LZMA_RUN);
-            if(ret != LZMA_OK && ret != LZMA_STREAM_END) {
-                throw std::runtime_error("Decompression failed.");
-            }
-            have = CHUNK - strm.avail_out;
-            if (fwrite(out.get(), 1, have, ofile) != have || ferror(ofile)) {
-                throw_system("Could not write to file:");
-            }
-        } while (strm.avail_out == 0);
-    } while (true);
+    return File(f);
 }
 
-
-uint64_t get_block_end(const std::vector<uint64_t> entry_offsets,
-        uint64_t j,
-        const uint64_t index_offset) {
-    ++j;
-    while(j < entry_offsets.size()) {
-        if(entry_offsets[j] != NO_OFFSET) {
-            return entry_offsets[j];
+/*
+ * Pipeline stage that decodes entry contents in archive order, and so
+ * every block once, while the previous piece is being written.
+ */
+void decode_entries(ArchiveReader &archive, BoundedQueue<tar_job> &jobs) {
+    const auto &entries = archive.entries();
+    tar_job job;
+    job.data = make_tempfile();
+    for(size_t i=0; i<entries.size(); i++) {
+        if(job.stored >= tar_job_size) {
+            if(!jobs.push(std::move(job))) {
+                return;
+            }
+            job = tar_job();
+            job.data = make_tempfile();
         }
-        ++j;
+        auto e = entries.get(i);
+        if(is_file(e)) {
+            job.file_starts.push_back(job.stored);
+            archive.read_entry(i, [&job](const unsigned char *buf, size_t size) {
+                job.data.write(buf, size);
+            });
+            job.stored = job.data.tell();
+        }
+        job.entries.push_back(std::move(e));
     }
-    return index_offset;
+    jobs.push(std::move(job));
 }
 
+void print_usage(const char *progname) {
+    printf("%s [options] <archive> <outdir>\n", progname);
+    printf("%s [options] --to-tar <tar file> <archive>\n", progname);
+    printf("\n");
+    printf("  -t, --to-tar F   write the contents as a tar stream to F, - for standard output\n");
 }
 
-void unpack(const char *fname, std::string outdir) {
-    File ifile(fname, "rb");
-    std::vector<fileinfo> entries;
-    std::vector<uint16_t> fname_sizes;
-    std::vector<uint64_t> entry_offsets;
-    ifile.seek(-28, SEEK_END);
-    auto magic = ifile.read32le();
-    if(magic != 12345678) {
-        printf("Bad magic number, invalid archive.\n");
-        return;
+}
+
+void unpack_tar(const char *fname, const std::string &tarname) {
+    ArchiveReader archive(fname);
+    File ofile = open_output(tarname);
+    TarWriter writer(ofile);
+    BoundedQueue<tar_job> jobs(tar_queue_size);
+    std::exception_ptr decode_error;
+    std::thread decoder([&] {
+        try {
+            decode_entries(archive, jobs);
+        } catch(...) {
+            decode_error = std::current_exception();
+        }
+        jobs.close();
+    });
+    try {
+        tar_job job;
+        while(jobs.pop(job)) {
+            auto m = job.data.mmap();
+            size_t file = 0;
+            for(const auto &e : job.entries) {
+                writer.add(e, is_file(e) ? m + job.file_starts[file++] : nullptr);
+            }
+        }
+    } catch(...) {
+        jobs.close();
+        decoder.join();
+        throw;
+    }
+    decoder.join();
+    // Leave out the end marker so a failed export does not look complete.
+    if(decode_error) {
+        std::rethrow_exception(decode_error);
     }
+    writer.finish();
+}
+
+void unpack(const char *fname, const std::string &outdir) {
     if(outdir.empty()) {
         printf("Extraction dir must not be empty.\n");
         return;
     }
-    if(outdir.back() != '/') {
-        outdir.push_back('/');
-    }
-    auto num_entries = ifile.read64le();
-    auto index_offset = ifile.read64le();
-    auto index_compressed_size = ifile.read64le();
-    entries.reserve(num_entries);
-    fname_sizes.reserve(num_entries);
-    entry_offsets.reserve(num_entries);
-    for(uint64_t j=0; j<num_entries; j++) {
-        fileinfo f;
-        entries.push_back(f);
-    }
-    printf("This file has %d entries.\n", (int)num_entries);
-//    printf("Index size: %d\n", (int)index_compressed_size);
-
-    auto mmap = ifile.mmap();
-    File index(tmpfile());
-    lzma_to_file((unsigned char*)mmap + index_offset, index_compressed_size, index.get());
-    index.seek(0, SEEK_SET);
-    for(auto &e : entries) {
-        e.uncompressed_size = index.read64le();
-    }
-    for(auto &e : entries) {
-        e.mode = index.read64le();
-    }
-    for(auto &e : entries) {
-        e.uid = index.read32le();
-    }
-    for(auto &e : entries) {
-        e.gid = index.read32le();
-    }
-    for(auto &e : entries) {
-        e.atime = index.read32le();
-    }
-    for(auto &e : entries) {
-        e.mtime = index.read32le();
-    }
-    for(uint64_t j=0; j<num_entries; j++) {
-        fname_sizes.push_back(index.read16le());
-    }
-    for(uint64_t j=0; j<num_entries; j++) {
-        entry_offsets.push_back(index.read64le());
-    }
-    // Filenames have variable length so they must be last.
-    for(uint64_t j=0; j<num_entries; j++) {
-        entries[j].fname = index.read(fname_sizes[j]);
-    }
+    ArchiveReader archive(fname);
+    const auto &entries = archive.entries();
+    printf("This file has %d entries.\n", (int)entries.size());
 
-    File unpack_file(tmpfile());
-    for(uint64_t j=0; j<num_entries; j++) {
-        auto &e = entries[j];
-        auto offset = entry_offsets[j];
-        auto ofname = outdir + e.fname;
+    Extractor extractor(outdir);
+    for(size_t j=0; j<entries.size(); j++) {
+        auto e = entries.get(j);
         printf("%s\n", e.fname.c_str());
         if(is_dir(e)) {
-            mkdir(ofname.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+            extractor.add_dir(e);
             continue;
         }
-        if(offset != NO_OFFSET) {
-            // Wasteful, writes to temp file. Should be able to write directly to
-            // outfile instead.
-            auto block_end = get_block_end(entry_offsets, j, index_offset); // Assumes index immediately follows data.
-            unpack_file.clear();
-            lzma_to_file(mmap + offset, block_end - offset, unpack_file.get());
-            unpack_file.flush();
-            unpack_file.seek(0, SEEK_SET);
-//            printf("Created temp file of size %d.\n", (int)unpack_file.size());
-        } else {
-//            printf("Continuing with existing unpackfile.\n");
+        if(archive.is_link(j)) {
+            extractor.add_link(e, entries.path(archive.link_target(j)));
+            continue;
         }
-        File ofile(ofname, "wb");
-        ofile.copy_from(unpack_file, e.uncompressed_size);
-        // FIXME restore metadata here.
+        if(archive.is_sparse(j)) {
+            extractor.add_file(e, [&archive, j](File &ofile) {
+                archive.read_data(j, [&ofile](uint64_t offset, const unsigned char *buf, size_t size) {
+                    ofile.seek(offset);
+                    ofile.write(buf, size);
+                });
+            }, true);
+            continue;
+        }
+        extractor.add_file(e, [&archive, j](File &ofile) {
+            archive.read_entry(j, [&ofile](const unsigned char *buf, size_t size) {
+                ofile.write(buf, size);
+            });
+        });
     }
+    extractor.finish();
 }
 
 int main(int argc, char **argv) {
-    if(argc != 3) {
-        printf("%s <archive> <outdir>\n", argv[0]);
+    std::string tarname;
+    const struct option long_options[] = {
+        {"to-tar", required_argument, nullptr, 't'},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int c;
+    while((c = getopt_long(argc, argv, "t:h", long_options, nullptr)) != -1) {
+        switch(c) {
+        case 't':
+            tarname = optarg;
+            break;
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        default:
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if(!tarname.empty()) {
+        if(argc - optind != 1) {
+            print_usage(argv[0]);
+            return 1;
+        }
+    } else if(argc - optind != 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    try {
+        if(!tarname.empty()) {
+            unpack_tar(argv[optind], tarname);
+        } else {
+            unpack(argv[optind], argv[optind+1]);
+        }
+    } catch(const std::exception &e) {
+        fprintf(stderr, "%s\n", e.what());
         return 1;
     }
-    unpack(argv[1], argv[2]);
     return 0;
 }
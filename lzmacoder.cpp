@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2016-2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<lzmacoder.hpp>
+#include<utils.hpp>
+
+#include<endian.h>
+#include<cstdlib>
+#include<stdexcept>
+
+namespace {
+
+const int CHUNK=1024*1024;
+
+// Block header: filter type, delta distance and LZMA1 properties size.
+const size_t block_header_size = 4;
+
+}
+
+LzmaEncoder::LzmaEncoder() : strm(LZMA_STREAM_INIT), out(new unsigned char [CHUNK]), ofile(nullptr), written(0),
+    preset(LZMA_PRESET_DEFAULT) {
+}
+
+LzmaEncoder::~LzmaEncoder() {
+    lzma_end(&strm);
+}
+
+uint64_t LzmaEncoder::compress(const unsigned char *buf, uint64_t size,
+        const std::string &dict, const filter_chain &chain, File &f) {
+    start(dict, chain, f);
+    feed(buf, size);
+    return finish();
+}
+
+void LzmaEncoder::start(const std::string &dict, const filter_chain &chain, File &f) {
+    uint32_t filter_size;
+    lzma_options_lzma opt_lzma;
+    if(lzma_lzma_preset(&opt_lzma, preset)) {
+        throw std::runtime_error("Unsupported LZMA preset.");
+    }
+    if(!dict.empty() && chain.type == FILTER_NONE) {
+        opt_lzma.preset_dict = reinterpret_cast<const uint8_t*>(dict.data());
+        opt_lzma.preset_dict_size = dict.size();
+    }
+    filter_options fopts;
+    lzma_filter *filter = setup_filters(chain, &opt_lzma, fopts);
+    lzma_filter *lzma1 = filter;
+    while(lzma1->id != LZMA_FILTER_LZMA1) {
+        ++lzma1;
+    }
+
+    lzma_ret ret = lzma_raw_encoder(&strm, filter);
+    if(ret != LZMA_OK) {
+        throw std::runtime_error("Could not create LZMA encoder.");
+    }
+    if(lzma_properties_size(&filter_size, lzma1) != LZMA_OK) {
+        throw std::runtime_error("Could not determine LZMA properties size.");
+    }
+    std::string x(filter_size, 'X');
+    if(lzma_properties_encode(lzma1, (unsigned char*)x.data()) != LZMA_OK) {
+        throw std::runtime_error("Could not encode filter properties.");
+    }
+    ofile = &f;
+    ofile->write8(chain.type);
+    ofile->write8(chain.delta_distance);
+    ofile->write16le(filter_size);
+    ofile->write(x);
+    written = block_header_size + filter_size;
+    strm.next_out = out.get();
+    strm.avail_out = CHUNK;
+}
+
+void LzmaEncoder::write_out() {
+    size_t write_size = CHUNK - strm.avail_out;
+    ofile->write(out.get(), write_size);
+    written += write_size;
+    strm.next_out = out.get();
+    strm.avail_out = CHUNK;
+}
+
+void LzmaEncoder::feed(const unsigned char *buf, uint64_t size) {
+    strm.next_in = buf;
+    strm.avail_in = size;
+    while(strm.avail_in > 0) {
+        if(lzma_code(&strm, LZMA_RUN) != LZMA_OK) {
+            throw std::runtime_error("Compression failed.");
+        }
+        if(strm.avail_out == 0) {
+            write_out();
+        }
+    }
+}
+
+uint64_t LzmaEncoder::finish() {
+    while(true) {
+        lzma_ret ret = lzma_code(&strm, LZMA_FINISH);
+        if(strm.avail_out == 0 || ret == LZMA_STREAM_END) {
+            write_out();
+        }
+        if(ret == LZMA_STREAM_END) {
+            break;
+        }
+        if(ret != LZMA_OK) {
+            throw std::runtime_error("Compression failed.");
+        }
+    }
+    ofile = nullptr;
+    return written;
+}
+
+LzmaDecoder::LzmaDecoder() : strm(LZMA_STREAM_INIT), out(new unsigned char [CHUNK]) {
+}
+
+LzmaDecoder::~LzmaDecoder() {
+    lzma_end(&strm);
+}
+
+void LzmaDecoder::decompress(const unsigned char *data_start, uint64_t data_size, FILE *ofile,
+        const std::string &dict) {
+    decompress(data_start, data_size, [ofile](const unsigned char *buf, size_t size) {
+        if (fwrite(buf, 1, size, ofile) != size || ferror(ofile)) {
+            throw_system("Could not write to file:");
+        }
+    }, dict);
+}
+
+void LzmaDecoder::decompress(const unsigned char *data_start, uint64_t data_size, const data_sink &sink,
+        const std::string &dict) {
+    lzma_filter lzma1;
+    filter_chain chain;
+    filter_options fopts;
+    unsigned int have;
+
+    chain.type = data_start[0];
+    chain.delta_distance = data_start[1];
+    size_t offset = 2;
+    uint16_t properties_size = le16toh(*reinterpret_cast<const uint16_t*>(data_start + offset));
+    offset+=2;
+    lzma1.id = LZMA_FILTER_LZMA1;
+    lzma_ret ret = lzma_properties_decode(&lzma1, nullptr, data_start + offset, properties_size);
+    offset += properties_size;
+    if(ret != LZMA_OK) {
+        throw std::runtime_error("Could not decode LZMA properties.");
+    }
+    std::unique_ptr<void, void(*)(void*)> options_holder(lzma1.options, free);
+    // Filtered blocks are compressed without the dictionary.
+    if(!dict.empty() && chain.type == FILTER_NONE) {
+        auto opt_lzma = reinterpret_cast<lzma_options_lzma*>(lzma1.options);
+        opt_lzma->preset_dict = reinterpret_cast<const uint8_t*>(dict.data());
+        opt_lzma->preset_dict_size = dict.size();
+    }
+    ret = lzma_raw_decoder(&strm, setup_filters(chain, lzma1.options, fopts));
+    if(ret != LZMA_OK) {
+        throw std::runtime_error("Could not initialize LZMA decoder.");
+    }
+
+    const unsigned char *current = data_start + offset;
+    strm.avail_in = (size_t)(data_size - offset);
+    strm.next_in = current;
+    /* decompress until data ends */
+    do {
+        if (strm.total_in == data_size - offset)
+            break;
+
+        do {
+            strm.avail_out = CHUNK;
+            strm.next_out = out.get();
+            ret = lzma_code(&strm, LZMA_RUN);
+            if(ret != LZMA_OK && ret != LZMA_STREAM_END) {
+                throw std::runtime_error("Decompression failed.");
+            }
+            have = CHUNK - strm.avail_out;
+            sink(out.get(), have);
+        } while (strm.avail_out == 0);
+    } while (true);
+}
+
+CoderPool<LzmaEncoder>& encoder_pool() {
+    static CoderPool<LzmaEncoder> pool;
+    return pool;
+}
+
+CoderPool<LzmaDecoder>& decoder_pool() {
+    static CoderPool<LzmaDecoder> pool;
+    return pool;
+}
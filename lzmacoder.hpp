@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<filters.hpp>
+#include<file.hpp>
+
+#include<lzma.h>
+
+#include<cstdio>
+#include<functional>
+#include<memory>
+#include<mutex>
+#include<string>
+#include<vector>
+
+/*
+ * Compresses blocks into the archive block format. Creating an LZMA
+ * encoder allocates and clears a multi-megabyte match finder, so one
+ * object should be kept around and reused for all blocks. liblzma
+ * reuses the allocations when the stream is reinitialized. Output goes
+ * straight to the destination file through a fixed size buffer.
+ */
+class LzmaEncoder final {
+public:
+    LzmaEncoder();
+    LzmaEncoder(const LzmaEncoder &) = delete;
+    LzmaEncoder& operator=(const LzmaEncoder &) = delete;
+    ~LzmaEncoder();
+
+    /*
+     * Compress one block into ofile. Returns the number of bytes written.
+     * The dictionary is raw data, so it is not used when the chain has
+     * a filter that changes the bytes LZMA sees.
+     */
+    uint64_t compress(const unsigned char *buf, uint64_t size,
+            const std::string &dict, const filter_chain &chain, File &ofile);
+
+    /*
+     * The same split in parts for data that is not in one buffer.
+     */
+    void start(const std::string &dict, const filter_chain &chain, File &ofile);
+    void feed(const unsigned char *buf, uint64_t size);
+    uint64_t finish();
+
+    /*
+     * LZMA preset level used for the following blocks. Decoders do not
+     * need to know it, the properties are stored in the block header.
+     */
+    void set_preset(uint32_t new_preset) { preset = new_preset; }
+
+private:
+    void write_out();
+
+    lzma_stream strm;
+    std::unique_ptr<unsigned char[]> out;
+    File *ofile;
+    uint64_t written;
+    uint32_t preset;
+};
+
+typedef std::function<void(const unsigned char *buf, size_t size)> data_sink;
+
+/*
+ * Decompresses blocks written by LzmaEncoder. Reusable in the same way.
+ */
+class LzmaDecoder final {
+public:
+    LzmaDecoder();
+    LzmaDecoder(const LzmaDecoder &) = delete;
+    LzmaDecoder& operator=(const LzmaDecoder &) = delete;
+    ~LzmaDecoder();
+
+    void decompress(const unsigned char *data, uint64_t data_size, FILE *ofile,
+            const std::string &dict);
+    void decompress(const unsigned char *data, uint64_t data_size, const data_sink &sink,
+            const std::string &dict);
+
+private:
+    lzma_stream strm;
+    std::unique_ptr<unsigned char[]> out;
+};
+
+/*
+ * A set of idle coders shared between threads. A coder is taken out with
+ * acquire() and goes back to the pool when the returned handle dies.
+ */
+template<typename Coder>
+class CoderPool final {
+private:
+    struct Releaser {
+        CoderPool *pool;
+        void operator()(Coder *c) const { pool->release(c); }
+    };
+
+public:
+    typedef std::unique_ptr<Coder, Releaser> Handle;
+
+    CoderPool() = default;
+    CoderPool(const CoderPool &) = delete;
+    CoderPool& operator=(const CoderPool &) = delete;
+
+    Handle acquire() {
+        std::lock_guard<std::mutex> l(m);
+        if(idle.empty()) {
+            return Handle(new Coder(), Releaser{this});
+        }
+        Handle h(idle.back().release(), Releaser{this});
+        idle.pop_back();
+        return h;
+    }
+
+private:
+    void release(Coder *c) {
+        std::lock_guard<std::mutex> l(m);
+        idle.emplace_back(c);
+    }
+
+    std::mutex m;
+    std::vector<std::unique_ptr<Coder>> idle;
+};
+
+CoderPool<LzmaEncoder>& encoder_pool();
+CoderPool<LzmaDecoder>& decoder_pool();
@@ -22,59 +22,119 @@
 #else
 #include<sys/mman.h>
 #include<fcntl.h>
+#include<unistd.h>
 #endif
 
 #include<mmapper.hpp>
 #include<file.hpp>
 #include<utils.hpp>
 
+#include<utility>
+
+MMapper::MMapper(const File &f) : MMapper(f, 0, f.size()) {
+}
+
 #if defined(_WIN32)
-MMapper::MMapper(const File &f) {
-    map_size = f.size();
-    h = CreateFileMapping((HANDLE)_get_osfhandle(f.fileno()), nullptr, PAGE_READONLY, 0, 0, nullptr);
-    addr = MapViewOfFile(h, FILE_MAP_READ, 0, 0, 0);
+MMapper::MMapper(const File &f, uint64_t offset, uint64_t length) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    fd = f.fileno();
+    file_offset = offset - offset % info.dwAllocationGranularity;
+    map_size = length;
+    map_length = length + (offset - file_offset);
+    h = CreateFileMapping((HANDLE)_get_osfhandle(fd), nullptr, PAGE_READONLY, 0, 0, nullptr);
+    base = MapViewOfFile(h, FILE_MAP_READ, (DWORD)(file_offset >> 32), (DWORD)file_offset, (SIZE_T)map_length);
+    addr = reinterpret_cast<unsigned char*>(base) + (offset - file_offset);
+}
+
+void MMapper::advise(mmap_advice) const {
+}
+
+void MMapper::evict() const {
+}
+
+void MMapper::unmap() {
+    if(base) {
+        UnmapViewOfFile(base);
+        CloseHandle(h);
+        base = nullptr;
+    }
 }
 
 #else
-MMapper::MMapper(const File &f) {
-    map_size = f.size();
-    auto fdnum = f.fileno();
+MMapper::MMapper(const File &f, uint64_t offset, uint64_t length) {
+    static const uint64_t page_size = sysconf(_SC_PAGESIZE);
+    fd = f.fileno();
+    file_offset = offset - offset % page_size;
+    map_size = length;
+    map_length = length + (offset - file_offset);
     if(map_size == 0) {
-        addr = nullptr;
+        base = addr = nullptr;
     } else {
-        addr = ::mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fdnum, 0);
-        if(addr == MAP_FAILED) {
+        base = ::mmap(nullptr, map_length, PROT_READ, MAP_PRIVATE, fd, file_offset);
+        if(base == MAP_FAILED) {
             throw_system("Could not mmap file:");
         }
+        addr = reinterpret_cast<unsigned char*>(base) + (offset - file_offset);
     }
 }
-#endif
 
-MMapper::MMapper(MMapper && other) {
-    if(&other == this) {
+void MMapper::advise(mmap_advice advice) const {
+    if(!base) {
         return;
     }
-    this->addr = other.addr;
-    this->map_size = other.map_size;
-    other.addr = nullptr;
+    int a;
+    switch(advice) {
+    case ADVISE_SEQUENTIAL: a = MADV_SEQUENTIAL; break;
+    case ADVISE_RANDOM: a = MADV_RANDOM; break;
+    case ADVISE_WILLNEED: a = MADV_WILLNEED; break;
+    case ADVISE_DONTNEED: a = MADV_DONTNEED; break;
+    default: a = MADV_NORMAL; break;
+    }
+    madvise(base, map_length, a);
+}
+
+void MMapper::evict() const {
+    if(!base) {
+        return;
+    }
+    madvise(base, map_length, MADV_DONTNEED);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, file_offset, map_length, POSIX_FADV_DONTNEED);
+#endif
+}
+
+void MMapper::unmap() {
+    if(base) {
+        munmap(base, map_length);
+        base = nullptr;
+    }
+}
+#endif
+
+MMapper::MMapper(MMapper && other) {
+    base = nullptr;
+    *this = std::move(other);
 }
 
 MMapper& MMapper::operator=(MMapper &&other) {
     if(&other != this) {
+        unmap();
+        this->base = other.base;
         this->addr = other.addr;
         this->map_size = other.map_size;
+        this->map_length = other.map_length;
+        this->file_offset = other.file_offset;
+        this->fd = other.fd;
+#if defined(_WIN32)
+        this->h = other.h;
+#endif
+        other.base = nullptr;
         other.addr = nullptr;
     }
     return *this;
 }
 
 MMapper::~MMapper() {
-#if defined(_WIN32)
-    UnmapViewOfFile(addr);
-    CloseHandle(h);
-#else
-  if(addr) {
-        munmap(addr, map_size);
-    }
-#endif
+    unmap();
 }
@@ -25,9 +25,19 @@
 
 class File;
 
+enum mmap_advice {
+    ADVISE_NORMAL,
+    ADVISE_SEQUENTIAL,
+    ADVISE_RANDOM,
+    ADVISE_WILLNEED,
+    ADVISE_DONTNEED,
+};
+
 class MMapper final {
 public:
     explicit MMapper(const File &file);
+    // Map only length bytes starting at offset, which need not be page aligned.
+    MMapper(const File &file, uint64_t offset, uint64_t length);
     MMapper(const MMapper&) = delete;
     MMapper(MMapper && other);
     MMapper& operator=(const MMapper &) = delete;
@@ -38,9 +48,24 @@ public:
 
     operator unsigned char*() { return reinterpret_cast<unsigned char*>(addr); }
 
+    // Hints are best effort, failures are ignored.
+    void advise(mmap_advice advice) const;
+
+    /*
+     * Drop the mapped range from the page cache. For data that has been
+     * streamed through once and will not be needed again.
+     */
+    void evict() const;
+
 private:
+    void unmap();
+
+    void *base;
     void *addr;
     uint64_t map_size;
+    uint64_t map_length;
+    uint64_t file_offset;
+    int fd;
 #if defined(_WIN32)
     HANDLE h;
 #endif
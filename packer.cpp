@@ -0,0 +1,886 @@
+/*
+ * Copyright (C) 2016-2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<packer.hpp>
+#include<archive.hpp>
+#include<chunker.hpp>
+#include<entrytable.hpp>
+#include<filters.hpp>
+#include<mmapper.hpp>
+#include<utils.hpp>
+
+#include<endian.h>
+#include<sys/stat.h>
+#include<unistd.h>
+
+#include<algorithm>
+#include<cerrno>
+#include<cstdio>
+#include<cstring>
+#include<stdexcept>
+
+namespace {
+
+// The preset dictionary is fed to the encoder for every block so keep it
+// small compared to the block size.
+const uint64_t dict_max_size = 256*1024;
+const uint64_t dict_sample_size = 8*1024;
+
+const size_t max_block_entries = 16*1024;
+
+const uint32_t CHECKPOINT_MAGIC = 0x43504b4a;
+
+// Creates the file of one index column. The name is unique within the index.
+typedef std::function<File(const char *name)> column_opener;
+
+/*
+ * The column files and counters of the index, which is all a checkpoint
+ * needs to save apart from the directory chain.
+ */
+struct index_state {
+    std::vector<File*> files;
+    std::vector<uint64_t*> counters;
+};
+
+/*
+ * The index is written one column at a time for maximal compression.
+ * Columns are spilled into temp files while packing so they need not
+ * be held in memory. The layout is the one EntryTable reads.
+ */
+class IndexColumns final {
+public:
+    explicit IndexColumns(const column_opener &open) : sizes(open("sizes")), modes(open("modes")),
+        uids(open("uids")), gids(open("gids")), atimes(open("atimes")), mtimes(open("mtimes")),
+        parents(open("parents")), name_sizes(open("name_sizes")), offsets(open("offsets")), names(open("names")),
+        count(0) {
+    }
+
+    void state(index_state &s) {
+        s.files.insert(s.files.end(), {&sizes, &modes, &uids, &gids, &atimes, &mtimes, &parents, &name_sizes,
+                &offsets, &names});
+        s.counters.push_back(&count);
+    }
+
+    ParentTracker& parent_tracker() { return tracker; }
+
+    void add(const fileinfo &e, uint64_t offset) {
+        if(count >= NO_PARENT) {
+            throw std::runtime_error("Too many entries for one archive.");
+        }
+        auto parent = tracker.add(e.fname, is_dir(e), count, base);
+        sizes.write64le(e.uncompressed_size);
+        modes.write64le(e.mode);
+        uids.write32le(e.uid);
+        gids.write32le(e.gid);
+        atimes.write32le(e.atime);
+        mtimes.write32le(e.mtime);
+        parents.write32le(parent);
+        name_sizes.write16le(base.size());
+        offsets.write64le(offset);
+        names.write(base);
+        ++count;
+    }
+
+    uint64_t num_entries() const { return count; }
+
+    // Size and mode of an earlier entry, read back from the columns.
+    uint64_t size_of(uint32_t id) const { return read_back(sizes, id); }
+    uint64_t mode_of(uint32_t id) const { return read_back(modes, id); }
+
+    uint64_t write(LzmaEncoder &encoder, File &ofile) {
+        // In index_column order.
+        const File *columns[] = {&sizes, &modes, &uids, &gids, &atimes, &mtimes, &parents, &name_sizes, &offsets, &names};
+        static_assert(sizeof(columns)/sizeof(columns[0]) == NUM_INDEX_COLUMNS, "Index column mismatch.");
+        uint64_t segment_sizes[NUM_INDEX_COLUMNS];
+        // The sizes are known only afterwards, fill them in then.
+        const auto table_offset = ofile.tell();
+        for(size_t i=0; i<NUM_INDEX_COLUMNS; i++) {
+            ofile.write64le(0);
+        }
+        for(size_t i=0; i<NUM_INDEX_COLUMNS; i++) {
+            auto m = columns[i]->mmap();
+            segment_sizes[i] = encoder.compress(m, m.size(), "", filter_chain(), ofile);
+        }
+        const auto end = ofile.tell();
+        ofile.seek(table_offset);
+        for(const auto &size : segment_sizes) {
+            ofile.write64le(size);
+        }
+        ofile.seek(end);
+        return end - table_offset;
+    }
+
+private:
+    static uint64_t read_back(const File &column, uint32_t id) {
+        column.flush();
+        uint64_t value;
+        if(pread(column.fileno(), &value, sizeof(value), (off_t)id*sizeof(value)) != sizeof(value)) {
+            throw_system("Could not read index column:");
+        }
+        return le64toh(value);
+    }
+
+    File sizes, modes, uids, gids, atimes, mtimes, parents, name_sizes, offsets, names;
+    uint64_t count;
+    ParentTracker tracker;
+    std::string base;
+};
+
+/*
+ * Chunk index columns, spilled the same way as the main index.
+ */
+class ChunkColumns final {
+public:
+    explicit ChunkColumns(const column_opener &open) : blocks(open("chunk_blocks")), starts(open("chunk_starts")),
+        sizes(open("chunk_sizes")), counts(open("chunk_counts")), refs(open("chunk_refs")), num_chunks(0) {
+    }
+
+    void state(index_state &s) {
+        s.files.insert(s.files.end(), {&blocks, &starts, &sizes, &counts, &refs});
+        s.counters.push_back(&num_chunks);
+    }
+
+    void add_chunk(uint64_t block_offset, uint64_t start, uint64_t size) {
+        blocks.write64le(block_offset);
+        starts.write32le(start);
+        sizes.write32le(size);
+        ++num_chunks;
+    }
+
+    uint64_t size() const { return num_chunks; }
+
+    void add_entry(const uint32_t *ids, uint32_t count) {
+        counts.write32le(count);
+        for(uint32_t i=0; i<count; i++) {
+            refs.write32le(ids[i]);
+        }
+    }
+
+    uint64_t write(LzmaEncoder &encoder, File &ofile) {
+        const File *columns[] = {&blocks, &starts, &sizes, &counts, &refs};
+        const uint64_t le_chunks = htole64(num_chunks);
+        encoder.start("", filter_chain(), ofile);
+        encoder.feed(reinterpret_cast<const unsigned char*>(&le_chunks), sizeof(le_chunks));
+        for(const auto &c : columns) {
+            auto m = c->mmap();
+            encoder.feed(m, m.size());
+        }
+        return encoder.finish();
+    }
+
+private:
+    File blocks, starts, sizes, counts, refs;
+    uint64_t num_chunks;
+};
+
+/*
+ * Sparse index columns.
+ */
+class SparseColumns final {
+public:
+    explicit SparseColumns(const column_opener &open) : ids(open("sparse_ids")), counts(open("sparse_counts")),
+        offsets(open("sparse_offsets")), sizes(open("sparse_sizes")), num_sparse(0) {
+    }
+
+    void state(index_state &s) {
+        s.files.insert(s.files.end(), {&ids, &counts, &offsets, &sizes});
+        s.counters.push_back(&num_sparse);
+    }
+
+    void add(uint32_t id, const std::vector<extent> &extents) {
+        ids.write32le(id);
+        counts.write32le(extents.size());
+        for(const auto &x : extents) {
+            offsets.write64le(x.offset);
+            sizes.write64le(x.size);
+        }
+        ++num_sparse;
+    }
+
+    bool empty() const { return num_sparse == 0; }
+
+    uint64_t write(LzmaEncoder &encoder, File &ofile) {
+        const File *columns[] = {&ids, &counts, &offsets, &sizes};
+        const uint64_t le_sparse = htole64(num_sparse);
+        encoder.start("", filter_chain(), ofile);
+        encoder.feed(reinterpret_cast<const unsigned char*>(&le_sparse), sizeof(le_sparse));
+        for(const auto &c : columns) {
+            auto m = c->mmap();
+            encoder.feed(m, m.size());
+        }
+        return encoder.finish();
+    }
+
+private:
+    File ids, counts, offsets, sizes;
+    uint64_t num_sparse;
+};
+
+/*
+ * Link index columns.
+ */
+class LinkColumns final {
+public:
+    explicit LinkColumns(const column_opener &open) : ids(open("link_ids")), targets(open("link_targets")),
+        num_links(0) {
+    }
+
+    void state(index_state &s) {
+        s.files.insert(s.files.end(), {&ids, &targets});
+        s.counters.push_back(&num_links);
+    }
+
+    void add(uint32_t id, uint32_t target) {
+        ids.write32le(id);
+        targets.write32le(target);
+        ++num_links;
+    }
+
+    bool empty() const { return num_links == 0; }
+
+    uint64_t write(LzmaEncoder &encoder, File &ofile) {
+        const File *columns[] = {&ids, &targets};
+        const uint64_t le_links = htole64(num_links);
+        encoder.start("", filter_chain(), ofile);
+        encoder.feed(reinterpret_cast<const unsigned char*>(&le_links), sizeof(le_links));
+        for(const auto &c : columns) {
+            auto m = c->mmap();
+            encoder.feed(m, m.size());
+        }
+        return encoder.finish();
+    }
+
+private:
+    File ids, targets;
+    uint64_t num_links;
+};
+
+/*
+ * Path hashes and full paths of all entries in order, turned into the
+ * path table at the end. Only the table being built is held in memory.
+ */
+class PathHashes final {
+public:
+    explicit PathHashes(const column_opener &open) : hashes(open("path_hashes")),
+        offsets(open("path_offsets")), paths(open("path_names")), count(0), paths_size(0) {
+    }
+
+    void state(index_state &s) {
+        s.files.insert(s.files.end(), {&hashes, &offsets, &paths});
+        s.counters.push_back(&count);
+        s.counters.push_back(&paths_size);
+    }
+
+    void add(const std::string &path) {
+        hashes.write64le(path_hash(path));
+        offsets.write64le(paths_size);
+        paths.write(path);
+        paths_size += path.size();
+        ++count;
+    }
+
+    /*
+     * Only the entry id of each slot is kept in memory, the rest of a
+     * slot is read back by id as it is written.
+     */
+    uint64_t write(File &ofile) {
+        // At most half full so that probe sequences stay short.
+        uint64_t num_slots = 1;
+        while(num_slots < 2*count) {
+            num_slots *= 2;
+        }
+        std::vector<uint32_t> slot_ids(num_slots, NO_PARENT);
+        auto hash_map = hashes.mmap();
+        auto offset_map = offsets.mmap();
+        auto read64 = [](MMapper &m, uint64_t i) {
+            uint64_t v;
+            memcpy(&v, (unsigned char*)m + i*sizeof(v), sizeof(v));
+            return le64toh(v);
+        };
+        for(uint64_t id=0; id<count; id++) {
+            auto slot = read64(hash_map, id) & (num_slots-1);
+            while(slot_ids[slot] != NO_PARENT) {
+                slot = (slot+1) & (num_slots-1);
+            }
+            slot_ids[slot] = id;
+        }
+        ofile.write64le(num_slots);
+        for(const auto &id : slot_ids) {
+            if(id == NO_PARENT) {
+                ofile.write64le(0);
+                ofile.write64le(0);
+                ofile.write32le(NO_PARENT);
+                ofile.write32le(0);
+                continue;
+            }
+            const auto start = read64(offset_map, id);
+            const auto end = id + 1 < count ? read64(offset_map, id + 1) : paths_size;
+            ofile.write64le(read64(hash_map, id));
+            ofile.write64le(start);
+            ofile.write32le(id);
+            ofile.write32le(end - start);
+        }
+        ofile.append(paths);
+        return sizeof(uint64_t) + num_slots*PATH_SLOT_SIZE + paths_size;
+    }
+
+private:
+    File hashes, offsets, paths;
+    uint64_t count;
+    uint64_t paths_size;
+};
+
+// Links are in entry order, next_link is the first one not yet passed.
+bool next_is_link(const block_job &job, size_t pos, size_t next_link) {
+    return next_link < job.links.size() && job.links[next_link].first == pos;
+}
+
+std::string read_string(File &f) {
+    const auto size = f.read64le();
+    if(size > f.size()) {
+        throw std::runtime_error("Corrupt checkpoint, string too long.");
+    }
+    return f.read(size);
+}
+
+void write_string(File &f, const std::string &s) {
+    f.write64le(s.size());
+    f.write(s);
+}
+
+void compress_block(LzmaEncoder &encoder, const block_job &job, const std::string &dict, File &ofile) {
+    auto buf = job.data.mmap();
+    auto chain = choose_filters(buf, buf.size(), job.file_starts);
+    encoder.compress(buf, buf.size(), dict, chain, ofile);
+}
+
+/*
+ * Build a preset dictionary out of the beginnings of files spread evenly
+ * over the first blocks. File headers are the part most likely to repeat
+ * between blocks. Packing is streamed so later files are not known yet.
+ */
+std::string build_dictionary(const std::vector<const block_job*> &jobs) {
+    std::vector<std::pair<const block_job*, size_t>> files;
+    for(const auto &j : jobs) {
+        for(size_t i=0; i<j->file_starts.size(); i++) {
+            files.emplace_back(j, i);
+        }
+    }
+    std::string dict;
+    const uint64_t num_samples = std::min<uint64_t>(files.size(), dict_max_size / dict_sample_size);
+    for(uint64_t i=0; i<num_samples; i++) {
+        const auto &sample = files[i*files.size()/num_samples];
+        const auto &starts = sample.first->file_starts;
+        auto start = starts[sample.second];
+        auto end = sample.second + 1 < starts.size() ? starts[sample.second+1] : sample.first->stored;
+        auto m = sample.first->data.mmap();
+        dict.append(reinterpret_cast<const char*>((unsigned char*)m + start),
+                std::min(end - start, dict_sample_size));
+    }
+    return dict;
+}
+
+}
+
+std::pair<uint32_t, bool> Deduplicator::add(const unsigned char *data, size_t size) {
+    const auto k = sha256(data, size);
+    auto it = chunks.find(k);
+    if(it != chunks.end()) {
+        return std::make_pair(it->second, false);
+    }
+    if(next_id >= NO_PARENT) {
+        throw std::runtime_error("Too many chunks for one archive.");
+    }
+    const uint32_t id = next_id++;
+    if(chunks.size() < max_tracked_chunks) {
+        chunks.emplace(k, id);
+    }
+    return std::make_pair(id, true);
+}
+
+bool LinkDetector::add(const fileinfo &e, uint32_t &target) {
+    const uint32_t id = next_id++;
+    if(!is_file(e) || e.nlink < 2) {
+        return false;
+    }
+    auto r = seen.emplace(inode_key{e.device, e.inode}, id);
+    if(r.second) {
+        return false;
+    }
+    target = r.first->second;
+    return true;
+}
+
+bool block_full(const block_job &job, const fileinfo &e, uint64_t block_size) {
+    return job.entries.size() >= max_block_entries || (is_file(e) && job.stored >= block_size);
+}
+
+bool gather_chunks(block_job &job, fileinfo &e, const File &ifile, bool sparse, std::vector<extent> extents,
+        Deduplicator &dedup, const block_consumer &consume, uint64_t block_size) {
+    std::vector<uint32_t> ids;
+    if(sparse) {
+        // The file may have shrunk after its extents were found.
+        const auto size = ifile.size();
+        clamp_extents(extents, size);
+        e.uncompressed_size = std::min(e.uncompressed_size, size);
+    } else {
+        extents.clear();
+        // Use what is actually there in case the file changed after stat.
+        e.uncompressed_size = ifile.size();
+        extents.push_back(extent{0, e.uncompressed_size});
+    }
+    // Chunks do not cross extents.
+    for(const auto &x : extents) {
+        auto m = ifile.mmap(x.offset, x.size);
+        uint64_t pos = 0;
+        while(pos < x.size) {
+            const auto n = next_chunk_size(m + pos, x.size - pos);
+            const auto chunk = dedup.add(m + pos, n);
+            if(chunk.second) {
+                if(job.stored >= block_size) {
+                    if(!consume(std::move(job))) {
+                        return false;
+                    }
+                    job = block_job();
+                    job.data = make_tempfile();
+                }
+                job.file_starts.push_back(job.stored);
+                job.data.write(m + pos, n);
+                job.stored += n;
+            }
+            ids.push_back(chunk.first);
+            pos += n;
+        }
+    }
+    job.chunk_counts.push_back(ids.size());
+    job.chunk_refs.insert(job.chunk_refs.end(), ids.begin(), ids.end());
+    if(sparse) {
+        job.sparse.emplace_back(job.entries.size(), std::move(extents));
+    }
+    return true;
+}
+
+struct Packer::index_writer {
+    explicit index_writer(const column_opener &open) : entries(open), chunks(open), sparse(open), links(open),
+        paths(open) {
+    }
+
+    index_state state() {
+        index_state s;
+        entries.state(s);
+        chunks.state(s);
+        sparse.state(s);
+        links.state(s);
+        paths.state(s);
+        return s;
+    }
+
+    IndexColumns entries;
+    ChunkColumns chunks;
+    SparseColumns sparse;
+    LinkColumns links;
+    PathHashes paths;
+};
+
+Packer::Packer(const std::string &ofname, uint32_t preset, bool dedup, bool path_table,
+        const checkpoint_options &ckpt) : ofile(ofname, ckpt.resume ? "r+b" : "wb"),
+    encoder(encoder_pool().acquire()), num_blocks(0), dedup(dedup), path_table(path_table),
+    checkpoint_dir(ckpt.dir), resume(ckpt.resume) {
+    encoder->set_preset(preset);
+    if(checkpoint_dir.empty()) {
+        if(resume) {
+            throw std::logic_error("Resuming needs a checkpoint directory.");
+        }
+        index.reset(new index_writer([](const char *) { return make_tempfile(); }));
+        ofile.write("JPAK0", 4);
+        return;
+    }
+    // The chunks seen so far are only kept in memory.
+    if(dedup) {
+        throw std::runtime_error("Deduplicated archives can not be checkpointed.");
+    }
+    if(!resume) {
+        if(mkdir(checkpoint_dir.c_str(), 0700) != 0 && errno != EEXIST) {
+            throw_system("Could not create checkpoint directory:");
+        }
+        // A checkpoint of an earlier run must not be resumed into this one.
+        unlink((checkpoint_dir + "/state").c_str());
+    }
+    index.reset(new index_writer([this](const char *name) { return open_column(name); }));
+    if(resume) {
+        restore();
+    } else {
+        ofile.write("JPAK0", 4);
+    }
+}
+
+Packer::~Packer() = default;
+
+/*
+ * The dictionary is only built once the second block exists, since an
+ * archive that fits in one block does not benefit from it.
+ */
+void Packer::add(block_job &&job) {
+    if(!dict_ranges.empty()) {
+        throw std::logic_error("Can not add blocks to merged archives.");
+    }
+    ++num_blocks;
+    if(num_blocks == 1) {
+        first = std::move(job);
+        return;
+    }
+    if(num_blocks == 2) {
+        dict = build_dictionary({&first, &job});
+        if(!dict.empty()) {
+            trailer.dict_offset = ofile.tell();
+            trailer.dict_size = encoder->compress(reinterpret_cast<const unsigned char*>(dict.data()),
+                    dict.size(), "", filter_chain(), ofile);
+        }
+        write_block(first);
+        first = block_job();
+    }
+    write_block(job);
+}
+
+/*
+ * Offsets in the merged archive move by the same amount as the data
+ * region of the input. The chunks of different inputs are not matched
+ * against each other.
+ */
+void Packer::merge(const std::string &fname) {
+    if(!checkpoint_dir.empty()) {
+        throw std::logic_error("Can not checkpoint merged archives.");
+    }
+    if(num_blocks > 0) {
+        throw std::logic_error("Can not merge into an archive with packed blocks.");
+    }
+    ArchiveReader in(fname);
+    const auto &t = in.trailer();
+    if(in.is_chunked() != dedup) {
+        throw std::runtime_error("Can not merge deduplicated and plain archives: " + fname);
+    }
+    // The dictionary and the blocks are everything between the magic and the index.
+    const uint64_t data_start = 4;
+    if(t.index_offset < data_start) {
+        throw std::runtime_error("Corrupt archive, index inside header: " + fname);
+    }
+    const uint64_t base = ofile.tell();
+    const uint64_t shift = base - data_start;
+    {
+        File src(fname, "rb");
+        src.seek(data_start);
+        ofile.copy_from(src, t.index_offset - data_start);
+    }
+    for(const auto &r : in.dict_ranges()) {
+        add_dict_range(dict_range{std::max(r.start, data_start) + shift, r.size > 0 ? r.offset + shift : 0, r.size});
+    }
+
+    const auto &entries = in.entries();
+    const auto &chunks = in.chunk_table();
+    const uint64_t first_id = index->entries.num_entries();
+    const uint64_t first_chunk = index->chunks.size();
+    if(dedup && first_chunk + chunks.num_chunks() >= NO_PARENT) {
+        throw std::runtime_error("Too many chunks for one archive.");
+    }
+    std::vector<uint32_t> ids;
+    for(size_t i=0; i<entries.size(); i++) {
+        const auto e = entries.get(i);
+        const extent *x;
+        size_t count;
+        if(in.sparse_table().extents(i, x, count)) {
+            index->sparse.add(first_id + i, std::vector<extent>(x, x + count));
+        }
+        if(in.is_link(i)) {
+            index->links.add(first_id + i, first_id + in.link_target(i));
+        }
+        auto offset = entries.offset(i);
+        if(offset != NO_OFFSET) {
+            offset += shift;
+        }
+        index->entries.add(e, offset);
+        if(path_table) {
+            index->paths.add(e.fname);
+        }
+        if(dedup) {
+            const auto &refs = chunks.chunk_ids();
+            ids.assign(refs.begin() + chunks.first_ref(i), refs.begin() + chunks.first_ref(i+1));
+            for(auto &id : ids) {
+                id += first_chunk;
+            }
+            index->chunks.add_entry(ids.data(), ids.size());
+        }
+    }
+    for(size_t c=0; c<chunks.num_chunks(); c++) {
+        index->chunks.add_chunk(chunks.block_offset(c) + shift, chunks.start(c), chunks.size(c));
+    }
+}
+
+// An input without blocks starts where the next one does.
+void Packer::add_dict_range(const dict_range &r) {
+    while(!dict_ranges.empty() && dict_ranges.back().start >= r.start) {
+        dict_ranges.pop_back();
+    }
+    dict_ranges.push_back(r);
+}
+
+void Packer::finish() {
+    if(num_blocks == 1) {
+        write_block(first);
+        first = block_job();
+    }
+    trailer.index_offset = ofile.tell();
+    trailer.index_size = index->entries.write(*encoder, ofile);
+    trailer.num_entries = index->entries.num_entries();
+    if(dedup) {
+        trailer.chunk_index_offset = ofile.tell();
+        trailer.chunk_index_size = index->chunks.write(*encoder, ofile);
+    }
+    if(!index->sparse.empty()) {
+        trailer.sparse_index_offset = ofile.tell();
+        trailer.sparse_index_size = index->sparse.write(*encoder, ofile);
+    }
+    if(!index->links.empty()) {
+        trailer.link_index_offset = ofile.tell();
+        trailer.link_index_size = index->links.write(*encoder, ofile);
+    }
+    if(path_table) {
+        trailer.path_table_offset = ofile.tell();
+        trailer.path_table_size = index->paths.write(ofile);
+    }
+    if(!dict_ranges.empty()) {
+        File table(make_tempfile());
+        table.write64le(dict_ranges.size());
+        for(const auto &r : dict_ranges) {
+            table.write64le(r.start);
+        }
+        for(const auto &r : dict_ranges) {
+            table.write64le(r.offset);
+        }
+        for(const auto &r : dict_ranges) {
+            table.write64le(r.size);
+        }
+        auto m = table.mmap();
+        trailer.dict_table_offset = ofile.tell();
+        trailer.dict_table_size = encoder->compress(m, m.size(), "", filter_chain(), ofile);
+    }
+    write_trailer(ofile, trailer);
+    if(!checkpoint_dir.empty()) {
+        ofile.flush();
+        remove_checkpoint();
+    }
+}
+
+uint64_t Packer::num_entries() const {
+    return index->entries.num_entries();
+}
+
+/*
+ * The archive up to the last block and the index columns are synced to
+ * disk before the state that refers to them, which is replaced with a
+ * rename. A crash at any point leaves the previous checkpoint usable.
+ */
+void Packer::checkpoint() {
+    if(checkpoint_dir.empty() || num_blocks < 2) {
+        return;
+    }
+    auto s = index->state();
+    ofile.sync();
+    for(const auto &f : s.files) {
+        f->sync();
+    }
+    const auto tmpname = checkpoint_dir + "/state.tmp";
+    File state(tmpname, "wb");
+    state.write32le(CHECKPOINT_MAGIC);
+    state.write64le(ofile.tell());
+    state.write64le(num_blocks);
+    state.write64le(trailer.dict_offset);
+    state.write64le(trailer.dict_size);
+    state.write8(path_table);
+    state.write64le(s.files.size());
+    for(const auto &f : s.files) {
+        state.write64le(f->size());
+    }
+    state.write64le(s.counters.size());
+    for(const auto &c : s.counters) {
+        state.write64le(*c);
+    }
+    const auto &dirs = index->entries.parent_tracker().dir_chain();
+    state.write64le(dirs.size());
+    for(const auto &d : dirs) {
+        write_string(state, d.first);
+        state.write32le(d.second);
+    }
+    write_string(state, last);
+    write_string(state, dict);
+    state.sync();
+    state.close();
+    if(rename(tmpname.c_str(), (checkpoint_dir + "/state").c_str()) != 0) {
+        throw_system("Could not save checkpoint:");
+    }
+}
+
+File Packer::open_column(const char *name) {
+    column_names.push_back(name);
+    return File(checkpoint_dir + "/" + name, resume ? "r+b" : "w+b");
+}
+
+/*
+ * Anything written after the checkpoint is cut off, both from the
+ * archive and from the index columns.
+ */
+void Packer::restore() {
+    File state(checkpoint_dir + "/state", "rb");
+    if(state.read32le() != CHECKPOINT_MAGIC) {
+        throw std::runtime_error("Not a checkpoint: " + checkpoint_dir);
+    }
+    const auto length = state.read64le();
+    num_blocks = state.read64le();
+    trailer.dict_offset = state.read64le();
+    trailer.dict_size = state.read64le();
+    if((state.read8() != 0) != path_table) {
+        throw std::runtime_error("Checkpoint was made with different path table setting.");
+    }
+    if(length > ofile.size()) {
+        throw std::runtime_error("Archive is shorter than its checkpoint.");
+    }
+    auto s = index->state();
+    if(state.read64le() != s.files.size()) {
+        throw std::runtime_error("Checkpoint column count mismatch.");
+    }
+    for(const auto &f : s.files) {
+        const auto size = state.read64le();
+        if(size > f->size()) {
+            throw std::runtime_error("Index column is shorter than its checkpoint.");
+        }
+        f->truncate(size);
+    }
+    if(state.read64le() != s.counters.size()) {
+        throw std::runtime_error("Checkpoint counter count mismatch.");
+    }
+    for(const auto &c : s.counters) {
+        *c = state.read64le();
+    }
+    const auto num_dirs = state.read64le();
+    if(num_dirs > state.size()) {
+        throw std::runtime_error("Corrupt checkpoint, too many directories.");
+    }
+    ParentTracker::chain dirs(num_dirs);
+    for(auto &d : dirs) {
+        d.first = read_string(state);
+        d.second = state.read32le();
+    }
+    index->entries.parent_tracker().set_dir_chain(std::move(dirs));
+    last = read_string(state);
+    dict = read_string(state);
+    ofile.truncate(length);
+}
+
+// Failures are ignored, the archive itself is complete by now.
+void Packer::remove_checkpoint() {
+    for(const auto &name : column_names) {
+        unlink((checkpoint_dir + "/" + name).c_str());
+    }
+    unlink((checkpoint_dir + "/state").c_str());
+    unlink((checkpoint_dir + "/state.tmp").c_str());
+    rmdir(checkpoint_dir.c_str());
+}
+
+void Packer::add_sparse(const block_job &job) {
+    const uint32_t first_id = index->entries.num_entries();
+    for(const auto &s : job.sparse) {
+        index->sparse.add(first_id + s.first, s.second);
+    }
+}
+
+void Packer::write_block(const block_job &job) {
+    add_sparse(job);
+    if(dedup) {
+        write_chunk_block(job);
+        return;
+    }
+    uint64_t block_offset = NO_OFFSET;
+    if(!job.file_starts.empty()) {
+        block_offset = ofile.tell();
+        compress_block(*encoder, job, dict, ofile);
+    }
+    size_t next_link = 0;
+    for(size_t j=0; j<job.entries.size(); j++) {
+        const auto &e = job.entries[j];
+        // The first file of a block points to it, the rest follow on.
+        if(next_is_link(job, j, next_link)) {
+            add_link(e, job.links[next_link++].second);
+        } else if(is_file(e)) {
+            add_entry(e, block_offset);
+            block_offset = NO_OFFSET;
+        } else {
+            add_entry(e, NO_OFFSET);
+        }
+    }
+}
+
+void Packer::write_chunk_block(const block_job &job) {
+    if(!job.file_starts.empty()) {
+        const uint64_t block_offset = ofile.tell();
+        compress_block(*encoder, job, dict, ofile);
+        for(size_t i=0; i<job.file_starts.size(); i++) {
+            const auto end = i+1 < job.file_starts.size() ? job.file_starts[i+1] : job.stored;
+            index->chunks.add_chunk(block_offset, job.file_starts[i], end - job.file_starts[i]);
+        }
+    }
+    const uint32_t *ids = job.chunk_refs.data();
+    size_t next_link = 0;
+    for(size_t i=0; i<job.entries.size(); i++) {
+        if(next_is_link(job, i, next_link)) {
+            add_link(job.entries[i], job.links[next_link++].second);
+        } else {
+            add_entry(job.entries[i], NO_OFFSET);
+        }
+        index->chunks.add_entry(ids, job.chunk_counts[i]);
+        ids += job.chunk_counts[i];
+    }
+}
+
+void Packer::add_entry(const fileinfo &e, uint64_t offset) {
+    index->entries.add(e, offset);
+    if(path_table) {
+        index->paths.add(e.fname);
+    }
+    if(!checkpoint_dir.empty()) {
+        last = e.fname;
+    }
+}
+
+/*
+ * A link gets the size that was stored for its target, which may differ
+ * from what stat said if the file changed while packing. The target must
+ * not be a link itself.
+ */
+void Packer::add_link(const fileinfo &e, uint32_t target) {
+    if(target >= index->entries.num_entries() || !S_ISREG(index->entries.mode_of(target))) {
+        throw std::logic_error("Hard link to an entry that is not a file.");
+    }
+    fileinfo l(e);
+    l.uncompressed_size = index->entries.size_of(target);
+    index->links.add(index->entries.num_entries(), target);
+    index->entries.add(l, NO_OFFSET);
+    if(path_table) {
+        index->paths.add(l.fname);
+    }
+    if(!checkpoint_dir.empty()) {
+        last = l.fname;
+    }
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<file.hpp>
+#include<fileutils.hpp>
+#include<lzmacoder.hpp>
+#include<format.hpp>
+#include<sha256.hpp>
+
+#include<cstdint>
+#include<cstring>
+#include<functional>
+#include<memory>
+#include<string>
+#include<unordered_map>
+#include<utility>
+#include<vector>
+
+/*
+ * Entries whose data has been gathered into one temp file, waiting to
+ * be compressed into a block. Directories are carried along so that
+ * the index keeps traversal order.
+ */
+struct block_job {
+    std::vector<fileinfo> entries;
+    // When deduplicating these are the starts of new chunks instead.
+    std::vector<uint64_t> file_starts;
+    File data;
+    uint64_t stored = 0;
+    // Only used when deduplicating, chunk_counts is parallel to entries.
+    std::vector<uint32_t> chunk_counts;
+    std::vector<uint32_t> chunk_refs;
+    // Sparse files among entries as entry position and data extents.
+    std::vector<std::pair<size_t, std::vector<extent>>> sparse;
+    // Hard links among entries as entry position and the id of the
+    // entry they link to. These have no data in the block.
+    std::vector<std::pair<size_t, uint32_t>> links;
+};
+
+// Hands a finished job on. Returns false if the consumer has gone away.
+typedef std::function<bool(block_job &&)> block_consumer;
+
+/*
+ * Remembers the chunks stored so far by their SHA-256, so that even
+ * crafted input can not make two different chunks share an id. Memory
+ * use is about 100 bytes per remembered chunk. Once max_tracked_chunks
+ * are remembered, new chunks are still stored but not remembered, so
+ * duplicates of them are stored again.
+ */
+class Deduplicator final {
+public:
+    // 2M chunks cover some 32 GB of unique data at the average chunk size.
+    static const size_t max_tracked_chunks = 2*1024*1024;
+
+    // Returns the id of the chunk and whether it is new.
+    std::pair<uint32_t, bool> add(const unsigned char *data, size_t size);
+
+private:
+    struct key_hash {
+        size_t operator()(const sha256_digest &k) const {
+            size_t h;
+            memcpy(&h, k.data(), sizeof(h));
+            return h;
+        }
+    };
+    std::unordered_map<sha256_digest, uint32_t, key_hash> chunks;
+    uint32_t next_id = 0;
+};
+
+/*
+ * Finds files that are hard links to a file seen earlier. Entry ids
+ * are counted here, so every entry must be passed in archive order.
+ */
+class LinkDetector final {
+public:
+    // Ids start from first_id, for continuing an archive.
+    explicit LinkDetector(uint32_t first_id = 0) : next_id(first_id) {}
+
+    // Returns true and sets target to the id of the earlier entry if e is a link to it.
+    bool add(const fileinfo &e, uint32_t &target);
+
+private:
+    struct inode_key {
+        uint64_t device;
+        uint64_t inode;
+        bool operator==(const inode_key &o) const {
+            return device == o.device && inode == o.inode;
+        }
+    };
+    struct key_hash {
+        size_t operator()(const inode_key &k) const { return k.inode ^ (k.device << 32); }
+    };
+    std::unordered_map<inode_key, uint32_t, key_hash> seen;
+    uint32_t next_id;
+};
+
+// Whether e must go into a new block.
+bool block_full(const block_job &job, const fileinfo &e, uint64_t block_size);
+
+/*
+ * Split the data extents of a file into content defined chunks and
+ * gather the ones not seen before. A big file may fill several blocks,
+ * so full jobs are handed to consume. Returns false if the consumer has
+ * gone away. If sparse is false the whole file is stored and extents
+ * is not used.
+ */
+bool gather_chunks(block_job &job, fileinfo &e, const File &ifile, bool sparse, std::vector<extent> extents,
+        Deduplicator &dedup, const block_consumer &consume, uint64_t block_size);
+
+/*
+ * Where the index is kept while packing. With a directory the index
+ * columns are files in it and the archive can be checkpointed.
+ */
+struct checkpoint_options {
+    std::string dir;
+    // Continue from the last checkpoint in dir instead of starting over.
+    bool resume = false;
+};
+
+/*
+ * Writes block jobs into an archive and builds its index. Blocks are
+ * written in the order they are added.
+ */
+class Packer final {
+public:
+    // A path table is written if path_table is set.
+    Packer(const std::string &ofname, uint32_t preset, bool dedup, bool path_table = false,
+            const checkpoint_options &ckpt = checkpoint_options());
+    Packer(const Packer &) = delete;
+    Packer& operator=(const Packer &) = delete;
+    ~Packer();
+
+    void add(block_job &&job);
+    /*
+     * Append the dictionary and blocks of an existing archive as they
+     * are and add its entries to the index. Can not be mixed with add().
+     */
+    void merge(const std::string &fname);
+    // Write the index and the trailer.
+    void finish();
+
+    /*
+     * Save what has been added so far so that packing can be resumed
+     * from here if it is interrupted. Does nothing without a checkpoint
+     * directory or before the dictionary has been built.
+     */
+    void checkpoint();
+    uint64_t num_entries() const;
+    // Path of the last entry added, only kept with a checkpoint directory.
+    const std::string& last_path() const { return last; }
+
+private:
+    struct index_writer;
+
+    void add_sparse(const block_job &job);
+    void add_entry(const fileinfo &e, uint64_t offset);
+    void add_link(const fileinfo &e, uint32_t target);
+    void write_block(const block_job &job);
+    void write_chunk_block(const block_job &job);
+    void add_dict_range(const dict_range &r);
+    File open_column(const char *name);
+    void restore();
+    void remove_checkpoint();
+
+    File ofile;
+    CoderPool<LzmaEncoder>::Handle encoder;
+    std::unique_ptr<index_writer> index;
+    archive_trailer trailer;
+    std::string dict;
+    // Only set when merging.
+    std::vector<dict_range> dict_ranges;
+    // The first block waits until the dictionary can be built.
+    block_job first;
+    uint64_t num_blocks;
+    const bool dedup;
+    const bool path_table;
+    const std::string checkpoint_dir;
+    const bool resume;
+    // Column files in checkpoint_dir.
+    std::vector<std::string> column_names;
+    std::string last;
+};
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<protocol.hpp>
+#include<file.hpp>
+#include<mmapper.hpp>
+#include<utils.hpp>
+
+#include<endian.h>
+#include<sys/socket.h>
+#include<sys/un.h>
+#include<unistd.h>
+
+#include<cerrno>
+#include<cstring>
+#include<stdexcept>
+
+namespace {
+
+// Protects both sides from allocating whatever a corrupt header says.
+const uint32_t max_message_size = 1024*1024*1024;
+
+/*
+ * Receive exactly size bytes. A descriptor can only arrive with the
+ * first bytes of a message, so it is picked up from any of the calls.
+ */
+bool recv_all(int sock, char *buf, size_t size, int *fd) {
+    size_t done = 0;
+    while(done < size) {
+        struct iovec iov;
+        iov.iov_base = buf + done;
+        iov.iov_len = size - done;
+        union {
+            struct cmsghdr align;
+            char data[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data;
+        msg.msg_controllen = sizeof(control.data);
+        const auto got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if(got < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw_system("Could not read from socket:");
+        }
+        if(got == 0) {
+            if(done == 0) {
+                return false;
+            }
+            throw std::runtime_error("Connection closed in the middle of a message.");
+        }
+        for(auto *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+                int passed;
+                memcpy(&passed, CMSG_DATA(c), sizeof(passed));
+                if(fd && *fd < 0) {
+                    *fd = passed;
+                } else {
+                    close(passed);
+                }
+            }
+        }
+        done += got;
+    }
+    return true;
+}
+
+void send_all(int sock, const char *buf, size_t size) {
+    while(size > 0) {
+        const auto sent = send(sock, buf, size, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            throw_system("Could not write to socket:");
+        }
+        buf += sent;
+        size -= sent;
+    }
+}
+
+}
+
+void MessageWriter::put16le(uint16_t i) {
+    const uint16_t le = htole16(i);
+    buf.append(reinterpret_cast<const char*>(&le), sizeof(le));
+}
+
+void MessageWriter::put32le(uint32_t i) {
+    const uint32_t le = htole32(i);
+    buf.append(reinterpret_cast<const char*>(&le), sizeof(le));
+}
+
+void MessageWriter::put64le(uint64_t i) {
+    const uint64_t le = htole64(i);
+    buf.append(reinterpret_cast<const char*>(&le), sizeof(le));
+}
+
+void MessageWriter::put_stat(const fileinfo &e) {
+    put64le(e.uncompressed_size);
+    put64le(e.mode);
+    put32le(e.uid);
+    put32le(e.gid);
+    put32le(e.atime);
+    put32le(e.mtime);
+}
+
+const char* MessageReader::take(size_t size) {
+    if(size > msg.size() - pos) {
+        throw std::runtime_error("Truncated message.");
+    }
+    const char *p = msg.data() + pos;
+    pos += size;
+    return p;
+}
+
+uint8_t MessageReader::get8() {
+    return *take(1);
+}
+
+uint16_t MessageReader::get16le() {
+    uint16_t i;
+    memcpy(&i, take(sizeof(i)), sizeof(i));
+    return le16toh(i);
+}
+
+uint32_t MessageReader::get32le() {
+    uint32_t i;
+    memcpy(&i, take(sizeof(i)), sizeof(i));
+    return le32toh(i);
+}
+
+uint64_t MessageReader::get64le() {
+    uint64_t i;
+    memcpy(&i, take(sizeof(i)), sizeof(i));
+    return le64toh(i);
+}
+
+std::string MessageReader::get(size_t size) {
+    return std::string(take(size), size);
+}
+
+std::string MessageReader::rest() {
+    return get(msg.size() - pos);
+}
+
+void MessageReader::get_stat(fileinfo &e) {
+    e.uncompressed_size = get64le();
+    e.mode = get64le();
+    e.uid = get32le();
+    e.gid = get32le();
+    e.atime = get32le();
+    e.mtime = get32le();
+    e.inode = 0;
+    e.device = 0;
+    e.nlink = 1;
+    e.allocated = e.uncompressed_size;
+}
+
+void send_message(int sock, const std::string &payload, int fd) {
+    if(payload.size() > max_message_size) {
+        throw std::runtime_error("Message too big.");
+    }
+    const uint32_t header = htole32(payload.size());
+    if(fd < 0) {
+        send_all(sock, reinterpret_cast<const char*>(&header), sizeof(header));
+    } else {
+        struct iovec iov;
+        iov.iov_base = const_cast<uint32_t*>(&header);
+        iov.iov_len = sizeof(header);
+        union {
+            struct cmsghdr align;
+            char data[CMSG_SPACE(sizeof(int))];
+        } control;
+        memset(&control, 0, sizeof(control));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data;
+        msg.msg_controllen = sizeof(control.data);
+        auto *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(fd));
+        ssize_t sent;
+        do {
+            sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        } while(sent < 0 && errno == EINTR);
+        if(sent < 0) {
+            throw_system("Could not write to socket:");
+        }
+        // The descriptor went with the first byte.
+        send_all(sock, reinterpret_cast<const char*>(&header) + sent, sizeof(header) - sent);
+    }
+    send_all(sock, payload.data(), payload.size());
+}
+
+bool recv_message(int sock, std::string &payload, int *fd) {
+    if(fd) {
+        *fd = -1;
+    }
+    uint32_t header;
+    if(!recv_all(sock, reinterpret_cast<char*>(&header), sizeof(header), fd)) {
+        return false;
+    }
+    header = le32toh(header);
+    if(header > max_message_size) {
+        throw std::runtime_error("Message too big.");
+    }
+    payload.resize(header);
+    if(header > 0 && !recv_all(sock, &payload[0], header, fd)) {
+        throw std::runtime_error("Connection closed in the middle of a message.");
+    }
+    return true;
+}
+
+DaemonClient::DaemonClient(const std::string &socket_path) {
+    struct sockaddr_un addr;
+    if(socket_path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Socket path too long.");
+    }
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock < 0) {
+        throw_system("Could not create socket:");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+    if(connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(sock);
+        throw_system("Could not connect to jpakd:");
+    }
+}
+
+DaemonClient::~DaemonClient() {
+    close(sock);
+}
+
+std::string DaemonClient::request(daemon_op op, const std::string &archive, const std::string &path, int *fd) {
+    File archive_file(archive, "rb");
+    MessageWriter req;
+    req.put8(op);
+    req.put(path);
+    send_message(sock, req.data(), archive_file.fileno());
+    std::string reply;
+    if(!recv_message(sock, reply, fd)) {
+        throw std::runtime_error("jpakd closed the connection.");
+    }
+    if(reply.empty() || reply[0] != STATUS_OK) {
+        if(fd && *fd >= 0) {
+            close(*fd);
+        }
+        throw std::runtime_error(reply.empty() ? std::string("Empty reply from jpakd.") : reply.substr(1));
+    }
+    return reply;
+}
+
+fileinfo DaemonClient::stat(const std::string &archive, const std::string &path) {
+    const auto reply = request(OP_STAT, archive, path, nullptr);
+    MessageReader r(reply);
+    r.get8();
+    fileinfo e;
+    r.get_stat(e);
+    e.fname = path;
+    return e;
+}
+
+void DaemonClient::read(const std::string &archive, const std::string &path, const data_sink &sink) {
+    int fd;
+    const auto reply = request(OP_READ, archive, path, &fd);
+    File block;
+    if(fd >= 0) {
+        FILE *f = fdopen(fd, "rb");
+        if(!f) {
+            close(fd);
+            throw_system("Could not fdopen block file:");
+        }
+        block = File(f);
+    }
+    MessageReader r(reply);
+    r.get8();
+    const auto size = r.get64le();
+    const auto offset = r.get64le();
+    if(size == 0) {
+        return;
+    }
+    if(!block.get()) {
+        throw std::runtime_error("jpakd did not pass the block file.");
+    }
+    auto m = block.mmap(offset, size);
+    m.advise(ADVISE_SEQUENTIAL);
+    sink(m, m.size());
+}
+
+std::vector<fileinfo> DaemonClient::list(const std::string &archive) {
+    const auto reply = request(OP_LIST, archive, "", nullptr);
+    MessageReader r(reply);
+    r.get8();
+    const auto count = r.get64le();
+    if(count > reply.size()) {
+        throw std::runtime_error("Corrupt list reply.");
+    }
+    std::vector<fileinfo> entries(count);
+    for(auto &e : entries) {
+        r.get_stat(e);
+        e.fname = r.get(r.get16le());
+    }
+    return entries;
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<fileutils.hpp>
+#include<lzmacoder.hpp>
+
+#include<cstdint>
+#include<string>
+#include<vector>
+
+/*
+ * Messages between jpakd and its clients over a Unix stream socket.
+ * Every message is a u32le payload length followed by the payload.
+ *
+ * A request is an op byte and for stat and read the entry path in the
+ * rest. It comes with a read only descriptor of the archive, opened by
+ * the client so that the daemon never opens paths for it.
+ *
+ * A reply is a status byte. An error carries a message. A stat reply
+ * carries size, mode (u64), uid, gid, atime and mtime (u32). A read
+ * reply carries the data size and its offset (u64) in the file whose
+ * descriptor comes with the reply. A list reply carries the entry count
+ * (u64) and for every entry the stat fields, a u16le name length and
+ * the name.
+ */
+enum daemon_op : uint8_t {
+    OP_STAT = 1,
+    OP_READ = 2,
+    OP_LIST = 3,
+};
+
+enum daemon_status : uint8_t {
+    STATUS_OK = 0,
+    STATUS_ERROR = 1,
+};
+
+class MessageWriter final {
+public:
+    void put8(uint8_t i) { buf += (char)i; }
+    void put16le(uint16_t i);
+    void put32le(uint32_t i);
+    void put64le(uint64_t i);
+    void put(const std::string &s) { buf += s; }
+    // Stat fields of e, without the name.
+    void put_stat(const fileinfo &e);
+
+    const std::string& data() const { return buf; }
+
+private:
+    std::string buf;
+};
+
+// Throws if the message is shorter than what is read from it.
+class MessageReader final {
+public:
+    explicit MessageReader(const std::string &msg) : msg(msg), pos(0) {}
+
+    uint8_t get8();
+    uint16_t get16le();
+    uint32_t get32le();
+    uint64_t get64le();
+    std::string get(size_t size);
+    std::string rest();
+    void get_stat(fileinfo &e);
+
+private:
+    const char* take(size_t size);
+
+    const std::string &msg;
+    size_t pos;
+};
+
+// Send payload with fd attached if it is not negative.
+void send_message(int sock, const std::string &payload, int fd = -1);
+
+/*
+ * Receive one message. A passed descriptor is stored in fd, or -1 if
+ * there was none. Returns false if the peer closed the connection.
+ */
+bool recv_message(int sock, std::string &payload, int *fd = nullptr);
+
+/*
+ * Connection to jpakd. File data is read straight from the daemon's
+ * decoded block cache through the passed descriptor.
+ */
+class DaemonClient final {
+public:
+    explicit DaemonClient(const std::string &socket_path);
+    DaemonClient(const DaemonClient &) = delete;
+    DaemonClient& operator=(const DaemonClient &) = delete;
+    ~DaemonClient();
+
+    fileinfo stat(const std::string &archive, const std::string &path);
+    void read(const std::string &archive, const std::string &path, const data_sink &sink);
+    std::vector<fileinfo> list(const std::string &archive);
+
+private:
+    std::string request(daemon_op op, const std::string &archive, const std::string &path, int *fd);
+
+    int sock;
+};
@@ -0,0 +1,546 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<tar.hpp>
+#include<file.hpp>
+#include<utils.hpp>
+
+#include<sys/stat.h>
+
+#include<algorithm>
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<stdexcept>
+
+namespace {
+
+const uint64_t TAR_BLOCK = 512;
+
+// Field offsets and lengths of the ustar header.
+const size_t NAME_OFF = 0, NAME_LEN = 100;
+const size_t MODE_OFF = 100, UID_OFF = 108, GID_OFF = 116, ID_LEN = 8;
+const size_t SIZE_OFF = 124, MTIME_OFF = 136, NUM_LEN = 12;
+const size_t CHKSUM_OFF = 148, CHKSUM_LEN = 8;
+const size_t TYPE_OFF = 156;
+const size_t LINKNAME_OFF = 157, LINKNAME_LEN = 100;
+const size_t MAGIC_OFF = 257;
+const size_t VERSION_OFF = 263;
+const size_t PREFIX_OFF = 345, PREFIX_LEN = 155;
+
+// Old GNU sparse headers. The map continues in extension headers while
+// their last byte is set.
+const size_t SPARSE_OFF = 386, SPARSE_ENTRIES = 4;
+const size_t IS_EXTENDED_OFF = 482, REALSIZE_OFF = 483;
+const size_t EXT_SPARSE_ENTRIES = 21, EXT_IS_EXTENDED_OFF = 504;
+const size_t SPARSE_ENTRY_LEN = 2*NUM_LEN;
+
+// Largest values the octal header fields can hold.
+const uint64_t MAX_ID = 07777777;
+const uint64_t MAX_NUM = 077777777777;
+
+uint64_t padded(uint64_t size) {
+    return (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+std::string field_string(const unsigned char *h, size_t offset, size_t len) {
+    const char *start = reinterpret_cast<const char*>(h + offset);
+    return std::string(start, strnlen(start, len));
+}
+
+/*
+ * Numbers are octal text, or base-256 with the high bit set in the
+ * first byte for values that do not fit (a GNU extension).
+ */
+uint64_t parse_number(const unsigned char *h, size_t offset, size_t len) {
+    const unsigned char *p = h + offset;
+    uint64_t result = 0;
+    if(p[0] & 0x80) {
+        result = p[0] & 0x3f;
+        for(size_t i=1; i<len; i++) {
+            result = (result << 8) | p[i];
+        }
+        return result;
+    }
+    size_t i = 0;
+    while(i < len && p[i] == ' ') {
+        ++i;
+    }
+    for(; i<len && p[i] >= '0' && p[i] <= '7'; i++) {
+        result = result*8 + (p[i] - '0');
+    }
+    return result;
+}
+
+uint64_t header_checksum(const unsigned char *h) {
+    uint64_t sum = 0;
+    for(size_t i=0; i<TAR_BLOCK; i++) {
+        sum += (i >= CHKSUM_OFF && i < CHKSUM_OFF + CHKSUM_LEN) ? ' ' : h[i];
+    }
+    return sum;
+}
+
+bool checksum_ok(const unsigned char *h) {
+    return header_checksum(h) == parse_number(h, CHKSUM_OFF, CHKSUM_LEN);
+}
+
+// Zero padded octal that fills the field except for the final NUL.
+void put_number(unsigned char *h, size_t offset, size_t len, uint64_t value) {
+    snprintf(reinterpret_cast<char*>(h + offset), len, "%0*llo", (int)(len - 1), (unsigned long long)value);
+}
+
+// The length of a pax record includes the digits of the length itself.
+void add_pax_record(std::string &records, const std::string &key, const std::string &value) {
+    const size_t base = key.size() + value.size() + 3;
+    size_t len = base + std::to_string(base).size();
+    if(std::to_string(len).size() > std::to_string(base).size()) {
+        ++len;
+    }
+    records += std::to_string(len);
+    records += ' ';
+    records += key;
+    records += '=';
+    records += value;
+    records += '\n';
+}
+
+/*
+ * Values from pax extended headers that override the following
+ * ustar header. Records look like "<length> <key>=<value>\n".
+ */
+struct pax_overrides {
+    std::string path, linkpath;
+    std::string size, uid, gid, mtime, atime;
+    // GNU sparse files, formats 0.1 and 1.0.
+    std::string sparse_major, sparse_name, sparse_realsize, sparse_map;
+    bool old_sparse = false;
+
+    void parse(const std::string &data) {
+        size_t pos = 0;
+        while(pos < data.size()) {
+            char *end;
+            const auto len = strtoull(data.c_str() + pos, &end, 10);
+            const size_t key_start = end - data.c_str() + 1;
+            if(len == 0 || *end != ' ' || pos + len > data.size()) {
+                throw std::runtime_error("Corrupt pax extended header.");
+            }
+            const auto eq = data.find('=', key_start);
+            if(eq == std::string::npos || eq >= pos + len) {
+                throw std::runtime_error("Corrupt pax extended header.");
+            }
+            const auto key = data.substr(key_start, eq - key_start);
+            // Drop the trailing newline.
+            auto value = data.substr(eq + 1, pos + len - eq - 2);
+            if(key == "path") {
+                path = std::move(value);
+            } else if(key == "size") {
+                size = std::move(value);
+            } else if(key == "uid") {
+                uid = std::move(value);
+            } else if(key == "gid") {
+                gid = std::move(value);
+            } else if(key == "mtime") {
+                mtime = std::move(value);
+            } else if(key == "atime") {
+                atime = std::move(value);
+            } else if(key == "linkpath") {
+                linkpath = std::move(value);
+            } else if(key == "GNU.sparse.major") {
+                sparse_major = std::move(value);
+            } else if(key == "GNU.sparse.name") {
+                sparse_name = std::move(value);
+            } else if(key == "GNU.sparse.realsize" || key == "GNU.sparse.size") {
+                sparse_realsize = std::move(value);
+            } else if(key == "GNU.sparse.map") {
+                sparse_map = std::move(value);
+            } else if(key == "GNU.sparse.offset") {
+                // Format 0.0 repeats keys, which is not supported.
+                old_sparse = true;
+            }
+            pos += len;
+        }
+    }
+};
+
+// Tar names may end in a slash, entry names do not.
+std::string strip_slashes(std::string name) {
+    while(name.size() > 1 && name.back() == '/') {
+        name.pop_back();
+    }
+    return name;
+}
+
+// Only POSIX ustar has a prefix, GNU headers keep other fields there.
+std::string header_name(const unsigned char *h) {
+    auto name = field_string(h, NAME_OFF, NAME_LEN);
+    if(memcmp(h + MAGIC_OFF, "ustar", 6) == 0) {
+        auto prefix = field_string(h, PREFIX_OFF, PREFIX_LEN);
+        if(!prefix.empty()) {
+            name = prefix + '/' + name;
+        }
+    }
+    return name;
+}
+
+const char* type_name(char type) {
+    switch(type) {
+    case '2': return "symlinks";
+    case '3': return "character devices";
+    case '4': return "block devices";
+    case '6': return "FIFOs";
+    default: return "entries of this type";
+    }
+}
+
+// Extents must be in order, inside the file and add up to the stored data.
+void check_extents(const std::vector<extent> &extents, uint64_t real_size, uint64_t data_size) {
+    uint64_t end = 0;
+    uint64_t total = 0;
+    for(const auto &x : extents) {
+        if(x.offset < end || x.size > real_size || x.offset > real_size - x.size) {
+            throw std::runtime_error("Corrupt sparse map in tar stream.");
+        }
+        end = x.offset + x.size;
+        total += x.size;
+    }
+    if(total != data_size) {
+        throw std::runtime_error("Sparse map does not match the data in tar stream.");
+    }
+}
+
+// Zero sized extents only mark the end of the file in some writers.
+void add_extent(std::vector<extent> &extents, uint64_t offset, uint64_t size) {
+    if(size > 0) {
+        extents.push_back(extent{offset, size});
+    }
+}
+
+}
+
+TarReader::TarReader(File &input) : input(input), data_size(0), unread(0), file_size(0), sparse(false) {
+}
+
+bool TarReader::read_header(unsigned char *header) {
+    const auto got = fread(header, 1, TAR_BLOCK, input.get());
+    if(got == 0 && feof(input.get())) {
+        // Some writers leave out the end of archive marker.
+        return false;
+    }
+    if(got != TAR_BLOCK) {
+        throw std::runtime_error("Truncated tar stream.");
+    }
+    return true;
+}
+
+std::string TarReader::read_string(uint64_t size) {
+    auto s = input.read(size);
+    skip(padded(size) - size);
+    return s;
+}
+
+void TarReader::skip(uint64_t size) {
+    unsigned char buf[64*1024];
+    while(size > 0) {
+        const auto n = std::min<uint64_t>(size, sizeof(buf));
+        input.read(buf, n);
+        size -= n;
+    }
+}
+
+bool TarReader::next(fileinfo &e) {
+    skip(unread);
+    unread = 0;
+    data_size = 0;
+    link.clear();
+    sparse = false;
+    extents.clear();
+    pax_overrides pax;
+    std::string long_name, long_link;
+    unsigned char h[TAR_BLOCK];
+    while(true) {
+        if(!read_header(h)) {
+            return false;
+        }
+        if(std::all_of(h, h + TAR_BLOCK, [](unsigned char c) { return c == 0; })) {
+            return false;
+        }
+        if(!checksum_ok(h)) {
+            throw std::runtime_error("Corrupt tar header.");
+        }
+        uint64_t size = parse_number(h, SIZE_OFF, NUM_LEN);
+        const char type = h[TYPE_OFF];
+        if(type == 'L' || type == 'K') {
+            auto &target = type == 'L' ? long_name : long_link;
+            target = read_string(size);
+            target.resize(strnlen(target.c_str(), target.size()));
+            continue;
+        }
+        if(type == 'x') {
+            pax.parse(read_string(size));
+            continue;
+        }
+        if(type == 'g' || type == 'V') {
+            // Global headers and volume labels are not entries.
+            skip(padded(size));
+            continue;
+        }
+        if(!pax.size.empty()) {
+            size = strtoull(pax.size.c_str(), nullptr, 10);
+        }
+        if(!pax.path.empty()) {
+            e.fname = std::move(pax.path);
+        } else if(!long_name.empty()) {
+            e.fname = std::move(long_name);
+        } else {
+            e.fname = header_name(h);
+        }
+        e.fname = strip_slashes(std::move(e.fname));
+        unread = padded(size);
+        data_size = size;
+        uint64_t real_size = size;
+        mode_t file_type = 0;
+        const char *unsupported = nullptr;
+        if(pax.old_sparse) {
+            unsupported = "GNU sparse format 0.0 files";
+        } else if(type == '0' || type == '\0' || type == '7') {
+            file_type = S_IFREG;
+            // The map of a file with no data may be empty, but the size is always there.
+            if(pax.sparse_major == "1" || !pax.sparse_map.empty() || !pax.sparse_realsize.empty()) {
+                sparse = true;
+                if(!pax.sparse_name.empty()) {
+                    e.fname = strip_slashes(pax.sparse_name);
+                }
+                real_size = strtoull(pax.sparse_realsize.c_str(), nullptr, 10);
+                if(pax.sparse_major == "1") {
+                    const auto map_size = read_pax_sparse_map();
+                    if(map_size > size) {
+                        throw std::runtime_error("Sparse map larger than its entry in tar stream.");
+                    }
+                    unread -= map_size;
+                    data_size -= map_size;
+                } else {
+                    const char *p = pax.sparse_map.c_str();
+                    while(*p) {
+                        char *end;
+                        const auto offset = strtoull(p, &end, 10);
+                        if(*end != ',') {
+                            throw std::runtime_error("Corrupt sparse map in tar stream.");
+                        }
+                        const auto len = strtoull(end + 1, &end, 10);
+                        add_extent(extents, offset, len);
+                        p = *end == ',' ? end + 1 : end;
+                    }
+                }
+                check_extents(extents, real_size, data_size);
+            }
+        } else if(type == 'S') {
+            file_type = S_IFREG;
+            sparse = true;
+            real_size = parse_number(h, REALSIZE_OFF, NUM_LEN);
+            read_gnu_sparse_map(h);
+            check_extents(extents, real_size, data_size);
+        } else if(type == '1') {
+            file_type = S_IFREG;
+            if(!pax.linkpath.empty()) {
+                link = std::move(pax.linkpath);
+            } else if(!long_link.empty()) {
+                link = std::move(long_link);
+            } else {
+                link = field_string(h, LINKNAME_OFF, LINKNAME_LEN);
+            }
+            link = strip_slashes(std::move(link));
+            // Any data is a repeat of the target's and is skipped.
+            data_size = real_size = 0;
+        } else if(type == '5' || type == 'D') {
+            // GNU dump directories carry a listing, which is not needed.
+            file_type = S_IFDIR;
+            data_size = real_size = 0;
+        } else {
+            unsupported = type_name(type);
+        }
+        if(unsupported) {
+            fprintf(stderr, "Skipping %s: %s are not supported.\n", e.fname.c_str(), unsupported);
+            skip(unread);
+            unread = 0;
+            data_size = 0;
+            pax = pax_overrides();
+            long_name.clear();
+            long_link.clear();
+            continue;
+        }
+        e.mode = file_type | (parse_number(h, MODE_OFF, ID_LEN) & 07777);
+        e.uid = pax.uid.empty() ? parse_number(h, UID_OFF, ID_LEN) : strtoul(pax.uid.c_str(), nullptr, 10);
+        e.gid = pax.gid.empty() ? parse_number(h, GID_OFF, ID_LEN) : strtoul(pax.gid.c_str(), nullptr, 10);
+        e.mtime = pax.mtime.empty() ? parse_number(h, MTIME_OFF, NUM_LEN) : strtoull(pax.mtime.c_str(), nullptr, 10);
+        e.atime = pax.atime.empty() ? e.mtime : strtoull(pax.atime.c_str(), nullptr, 10);
+        e.inode = 0;
+        e.device = 0;
+        e.nlink = 1;
+        e.allocated = data_size;
+        e.uncompressed_size = file_size = real_size;
+        return true;
+    }
+}
+
+/*
+ * The map is in the main header and in as many extension headers after
+ * it as needed.
+ */
+void TarReader::read_gnu_sparse_map(const unsigned char *header) {
+    for(size_t i=0; i<SPARSE_ENTRIES; i++) {
+        const size_t off = SPARSE_OFF + i*SPARSE_ENTRY_LEN;
+        if(header[off] == 0) {
+            break;
+        }
+        add_extent(extents, parse_number(header, off, NUM_LEN), parse_number(header, off + NUM_LEN, NUM_LEN));
+    }
+    bool extended = header[IS_EXTENDED_OFF] != 0;
+    unsigned char ext[TAR_BLOCK];
+    while(extended) {
+        if(!read_header(ext)) {
+            throw std::runtime_error("Truncated tar stream.");
+        }
+        for(size_t i=0; i<EXT_SPARSE_ENTRIES; i++) {
+            const size_t off = i*SPARSE_ENTRY_LEN;
+            if(ext[off] == 0) {
+                break;
+            }
+            add_extent(extents, parse_number(ext, off, NUM_LEN), parse_number(ext, off + NUM_LEN, NUM_LEN));
+        }
+        extended = ext[EXT_IS_EXTENDED_OFF] != 0;
+    }
+}
+
+/*
+ * In format 1.0 the map is at the start of the data as decimal lines:
+ * the number of extents and then the offset and size of each. It is
+ * padded to a whole block. Returns how much of the data it took.
+ */
+uint64_t TarReader::read_pax_sparse_map() {
+    std::string text;
+    size_t pos = 0;
+    auto next_number = [&]() {
+        size_t nl;
+        while((nl = text.find('\n', pos)) == std::string::npos) {
+            if(text.size() >= unread) {
+                throw std::runtime_error("Corrupt sparse map in tar stream.");
+            }
+            text += input.read(TAR_BLOCK);
+        }
+        const auto value = strtoull(text.c_str() + pos, nullptr, 10);
+        pos = nl + 1;
+        return value;
+    };
+    const auto count = next_number();
+    for(uint64_t i=0; i<count; i++) {
+        const auto offset = next_number();
+        add_extent(extents, offset, next_number());
+    }
+    return text.size();
+}
+
+uint64_t TarReader::read_data(File &ofile) {
+    const auto size = data_size;
+    ofile.copy_from(input, data_size);
+    skip(unread - data_size);
+    unread = 0;
+    data_size = 0;
+    return size;
+}
+
+void TarReader::read_sparse_data(File &ofile) {
+    if(!sparse) {
+        read_data(ofile);
+        return;
+    }
+    for(const auto &x : extents) {
+        ofile.seek(x.offset);
+        ofile.copy_from(input, x.size);
+    }
+    ofile.truncate(file_size);
+    skip(unread - data_size);
+    unread = 0;
+    data_size = 0;
+}
+
+TarWriter::TarWriter(File &output) : output(output) {
+}
+
+void TarWriter::write_header(const std::string &name, uint64_t mode, uint32_t uid, uint32_t gid,
+        uint64_t size, uint64_t mtime, char type) {
+    unsigned char h[TAR_BLOCK];
+    memset(h, 0, sizeof(h));
+    memcpy(h + NAME_OFF, name.data(), std::min(name.size(), NAME_LEN));
+    put_number(h, MODE_OFF, ID_LEN, mode & 07777);
+    put_number(h, UID_OFF, ID_LEN, uid <= MAX_ID ? uid : 0);
+    put_number(h, GID_OFF, ID_LEN, gid <= MAX_ID ? gid : 0);
+    put_number(h, SIZE_OFF, NUM_LEN, size <= MAX_NUM ? size : 0);
+    put_number(h, MTIME_OFF, NUM_LEN, mtime);
+    h[TYPE_OFF] = type;
+    memcpy(h + MAGIC_OFF, "ustar", 6);
+    memcpy(h + VERSION_OFF, "00", 2);
+    put_number(h, CHKSUM_OFF, CHKSUM_LEN - 1, header_checksum(h));
+    h[CHKSUM_OFF + CHKSUM_LEN - 1] = ' ';
+    output.write(h, TAR_BLOCK);
+}
+
+void TarWriter::pad(uint64_t size) {
+    static const unsigned char zeros[TAR_BLOCK] = {};
+    output.write(zeros, padded(size) - size);
+}
+
+void TarWriter::add(const fileinfo &e, const unsigned char *data) {
+    // Like tar, store absolute names relative to the extraction dir.
+    auto start = e.fname.find_first_not_of('/');
+    if(start == std::string::npos) {
+        return;
+    }
+    auto name = e.fname.substr(start);
+    const uint64_t size = is_file(e) ? e.uncompressed_size : 0;
+    if(is_dir(e)) {
+        name += '/';
+    }
+    std::string records;
+    if(name.size() > NAME_LEN) {
+        add_pax_record(records, "path", name);
+    }
+    if(size > MAX_NUM) {
+        add_pax_record(records, "size", std::to_string(size));
+    }
+    if(e.uid > MAX_ID) {
+        add_pax_record(records, "uid", std::to_string(e.uid));
+    }
+    if(e.gid > MAX_ID) {
+        add_pax_record(records, "gid", std::to_string(e.gid));
+    }
+    if(!records.empty()) {
+        write_header("././@PaxHeader", 0644, 0, 0, records.size(), e.mtime, 'x');
+        output.write(records);
+        pad(records.size());
+    }
+    write_header(name, e.mode, e.uid, e.gid, size, e.mtime, is_dir(e) ? '5' : '0');
+    if(size > 0) {
+        output.write(data, size);
+        pad(size);
+    }
+}
+
+void TarWriter::finish() {
+    static const unsigned char zeros[2*TAR_BLOCK] = {};
+    output.write(zeros, sizeof(zeros));
+    output.flush();
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<fileutils.hpp>
+
+#include<cstdint>
+#include<string>
+#include<vector>
+
+class File;
+
+/*
+ * Reads a ustar, GNU or pax tar stream strictly sequentially so that it
+ * can come from a pipe. Regular files, hard links, GNU sparse files and
+ * directories are returned. Other entry types are skipped with a warning
+ * like symlinks are when walking a tree.
+ */
+class TarReader final {
+public:
+    explicit TarReader(File &input);
+    TarReader(const TarReader &) = delete;
+    TarReader& operator=(const TarReader &) = delete;
+
+    /*
+     * Read the header of the next entry. Data of the previous entry is
+     * skipped if it was not read. Returns false at the end of the stream.
+     */
+    bool next(fileinfo &e);
+
+    /*
+     * Append the data of the current entry to ofile. For a sparse file
+     * this is the data of its extents one after another. Returns the
+     * amount of data.
+     */
+    uint64_t read_data(File &ofile);
+
+    /*
+     * Write the data of the current entry into an empty ofile at its
+     * offsets in the file, leaving the holes of a sparse file unwritten.
+     */
+    void read_sparse_data(File &ofile);
+
+    // The path of the earlier entry that the current one is a hard link to, or empty.
+    const std::string& link_target() const { return link; }
+    // Whether the current entry is a sparse file. It may be all holes and have no extents.
+    bool is_sparse() const { return sparse; }
+    // The data extents of the current entry if it is a sparse file.
+    const std::vector<extent>& sparse_extents() const { return extents; }
+
+private:
+    bool read_header(unsigned char *header);
+    std::string read_string(uint64_t size);
+    void skip(uint64_t size);
+    void read_gnu_sparse_map(const unsigned char *header);
+    uint64_t read_pax_sparse_map();
+
+    File &input;
+    uint64_t data_size;
+    uint64_t unread;
+    uint64_t file_size;
+    std::string link;
+    bool sparse;
+    std::vector<extent> extents;
+};
+
+/*
+ * Writes entries as a ustar stream. Names that do not fit the header
+ * and numbers that are too big for it go in pax extended headers.
+ */
+class TarWriter final {
+public:
+    explicit TarWriter(File &output);
+    TarWriter(const TarWriter &) = delete;
+    TarWriter& operator=(const TarWriter &) = delete;
+
+    // Write e followed by e.uncompressed_size bytes of data.
+    void add(const fileinfo &e, const unsigned char *data);
+    // Write the end of archive marker.
+    void finish();
+
+private:
+    void write_header(const std::string &name, uint64_t mode, uint32_t uid, uint32_t gid,
+            uint64_t size, uint64_t mtime, char type);
+    void pad(uint64_t size);
+
+    File &output;
+};
@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include<tuner.hpp>
+#include<file.hpp>
+#include<lzmacoder.hpp>
+#include<utils.hpp>
+
+#include<algorithm>
+#include<chrono>
+#include<cmath>
+#include<cstdio>
+#include<random>
+
+namespace {
+
+typedef std::chrono::steady_clock trial_clock;
+
+// The sample is taken from the beginnings of files picked at random
+// from the whole input. Every candidate compresses all of it, so it is
+// kept small.
+const uint64_t sample_size = 4*1024*1024;
+const size_t max_sample_files = 64;
+
+// Candidates in order of increasing compression time.
+const uint32_t candidate_presets[] = {1, 3, 6, 9};
+const uint64_t candidate_block_sizes[] = {1024*1024, 4*1024*1024};
+
+// Measurements on a small sample are noisy and the real pack also has
+// to read its input, so require some headroom.
+const double safety_margin = 1.25;
+
+struct input_sample {
+    std::string data;
+    uint64_t total_size = 0;
+};
+
+struct trial_result {
+    uint32_t preset;
+    uint64_t block_size;
+    uint64_t compressed_size;
+    double throughput;
+};
+
+input_sample sample_input(const std::vector<std::string> &originals) {
+    input_sample sample;
+    std::vector<std::string> picked;
+    uint64_t num_files = 0;
+    std::mt19937_64 rng(0);
+    walk_files(originals, [&](fileinfo &&e) {
+        if(!is_file(e) || e.uncompressed_size == 0) {
+            return true;
+        }
+        sample.total_size += e.uncompressed_size;
+        ++num_files;
+        if(picked.size() < max_sample_files) {
+            picked.push_back(std::move(e.fname));
+        } else {
+            auto slot = rng() % num_files;
+            if(slot < max_sample_files) {
+                picked[slot] = std::move(e.fname);
+            }
+        }
+        return true;
+    });
+    for(size_t i=0; i<picked.size(); i++) {
+        // Space not used by small files goes to the following ones.
+        const uint64_t share = (sample_size - sample.data.size()) / (picked.size() - i);
+        File f(picked[i], "rb");
+        sample.data += f.read(std::min(share, f.size()));
+    }
+    return sample;
+}
+
+trial_result run_trial(LzmaEncoder &encoder, const std::string &sample, File &scratch,
+        uint32_t preset, uint64_t block_size) {
+    const auto *buf = reinterpret_cast<const unsigned char*>(sample.data());
+    trial_result r{preset, block_size, 0, 0};
+    encoder.set_preset(preset);
+    scratch.clear();
+    const auto start = trial_clock::now();
+    for(uint64_t pos=0; pos<sample.size(); pos+=block_size) {
+        const auto n = std::min<uint64_t>(block_size, sample.size() - pos);
+        r.compressed_size += encoder.compress(buf + pos, n, "", filter_chain(), scratch);
+    }
+    const std::chrono::duration<double> elapsed = trial_clock::now() - start;
+    r.throughput = sample.size() / std::max(elapsed.count(), 1e-6);
+    return r;
+}
+
+}
+
+void tune_compression(const std::vector<std::string> &originals, const tuning_goal &goal, pack_options &opts) {
+    const auto start = trial_clock::now();
+    const auto sample = sample_input(originals);
+    if(sample.data.empty()) {
+        return;
+    }
+    // Time spent sampling and in trials is taken out of the budget.
+    auto remaining = [&]() {
+        const std::chrono::duration<double> spent = trial_clock::now() - start;
+        return goal.time_budget - spent.count();
+    };
+    auto required = [&]() {
+        double r = goal.throughput;
+        if(goal.time_budget > 0) {
+            const double left = remaining();
+            r = std::max(r, left > 0 ? sample.total_size / left : HUGE_VAL);
+        }
+        return r * safety_margin;
+    };
+
+    File scratch(make_tempfile());
+    auto encoder = encoder_pool().acquire();
+    std::vector<trial_result> results;
+    trial_result fastest{0, 0, 0, 0};
+    bool out_of_time = false;
+    for(const auto preset : candidate_presets) {
+        bool any_fits = false;
+        for(const auto block_size : candidate_block_sizes) {
+            // A slower trial takes at least as long as the last one. Do
+            // not run it if that would leave too little time to pack
+            // even with the fastest setting so far.
+            if(goal.time_budget > 0 && !results.empty()) {
+                const double last_trial = sample.data.size() / results.back().throughput;
+                const double pack_time = sample.total_size * safety_margin / fastest.throughput;
+                if(remaining() - last_trial < pack_time) {
+                    out_of_time = true;
+                    break;
+                }
+            }
+            const auto r = run_trial(*encoder, sample.data, scratch, preset, block_size);
+            results.push_back(r);
+            if(r.throughput > fastest.throughput) {
+                fastest = r;
+            }
+            if(r.throughput >= required()) {
+                any_fits = true;
+            }
+        }
+        // Higher presets are only slower.
+        if(out_of_time || !any_fits) {
+            break;
+        }
+    }
+    // What is left of the budget once the trials are done decides.
+    const double needed = required();
+    trial_result best{0, 0, 0, 0};
+    for(const auto &r : results) {
+        if(r.throughput >= needed && (best.block_size == 0 || r.compressed_size < best.compressed_size)) {
+            best = r;
+        }
+    }
+    if(best.block_size == 0) {
+        best = fastest;
+        printf("No setting reaches the requested speed, using the fastest one.\n");
+    }
+    printf("Using preset %u with %llu kB blocks, %.1f MB/s and ratio %.3f on a sample.\n",
+            best.preset, (unsigned long long)(best.block_size/1024), best.throughput/(1024*1024),
+            (double)best.compressed_size / sample.data.size());
+    opts.preset = best.preset;
+    opts.block_size = best.block_size;
+}
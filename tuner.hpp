@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2017 Jussi Pakkanen.
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of version 3, or (at your option) any later version,
+ * of the GNU General Public License as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include<jpacker.hpp>
+
+struct tuning_goal {
+    // Seconds the whole pack may take, zero if not limited.
+    double time_budget = 0;
+    // Minimum input bytes per second, zero if not limited.
+    double throughput = 0;
+};
+
+/*
+ * Pick the preset and block size for opts by trial compressing a sample
+ * of the input. The smallest result that is fast enough wins. If no
+ * setting is fast enough the fastest one is used.
+ */
+void tune_compression(const std::vector<std::string> &originals, const tuning_goal &goal, pack_options &opts);